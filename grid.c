@@ -0,0 +1,252 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "grid.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void
+grid_init(struct grid *g)
+{
+	memset(g, 0, sizeof *g);
+}
+
+void
+grid_finish(struct grid *g)
+{
+	for (int i = 0; i < GRID_BUCKETS; ++i)
+		free(g->buckets[i].ids);
+	free(g->large.ids);
+	free(g->entries);
+}
+
+static struct grid_bucket *
+get_bucket(struct grid *g, int32_t cx, int32_t cy)
+{
+	uint32_t hash = ((uint32_t)cx * 73856093u) ^ ((uint32_t)cy * 19349663u);
+
+	return &g->buckets[hash % GRID_BUCKETS];
+}
+
+static int
+bucket_add(struct grid_bucket *b, uint32_t id)
+{
+	if (b->len == b->cap) {
+		uint32_t cap = b->cap ? b->cap * 2 : 8;
+		uint32_t *ids = realloc(b->ids, cap * sizeof *ids);
+		if (!ids) {
+			fprintf(stderr, "realloc: %s\n", strerror(errno));
+			return -1;
+		}
+
+		b->ids = ids;
+		b->cap = cap;
+	}
+
+	b->ids[b->len++] = id;
+	return 0;
+}
+
+/* Removes one instance of the id */
+static void
+bucket_remove(struct grid_bucket *b, uint32_t id)
+{
+	for (uint32_t i = 0; i < b->len; ++i) {
+		if (b->ids[i] == id) {
+			b->ids[i] = b->ids[--b->len];
+			return;
+		}
+	}
+}
+
+static int
+ensure_entries(struct grid *g, uint32_t id)
+{
+	uint32_t cap = g->entries_cap ? g->entries_cap : 64;
+	struct grid_entry *entries;
+
+	if (id < g->entries_cap)
+		return 0;
+
+	while (cap <= id)
+		cap *= 2;
+
+	entries = realloc(g->entries, cap * sizeof *entries);
+	if (!entries) {
+		fprintf(stderr, "realloc: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(entries + g->entries_cap, 0,
+	       (cap - g->entries_cap) * sizeof *entries);
+	g->entries = entries;
+	g->entries_cap = cap;
+
+	return 0;
+}
+
+void
+grid_remove(struct grid *g, uint32_t id)
+{
+	struct grid_entry *e;
+
+	if (id >= g->entries_cap || !g->entries[id].present)
+		return;
+
+	e = &g->entries[id];
+	if (e->large) {
+		bucket_remove(&g->large, id);
+	} else {
+		for (int32_t cy = e->cy1; cy <= e->cy2; ++cy)
+			for (int32_t cx = e->cx1; cx <= e->cx2; ++cx)
+				bucket_remove(get_bucket(g, cx, cy), id);
+	}
+
+	e->present = false;
+}
+
+int
+grid_insert(struct grid *g, uint32_t id, const struct rect *rect)
+{
+	struct grid_entry *e;
+
+	grid_remove(g, id);
+
+	if (rect->width <= 0 || rect->height <= 0)
+		return 0;
+
+	if (ensure_entries(g, id) < 0)
+		return -1;
+
+	e = &g->entries[id];
+	e->rect = *rect;
+	e->cx1 = rect->x >> GRID_CELL_SHIFT;
+	e->cy1 = rect->y >> GRID_CELL_SHIFT;
+	e->cx2 = (rect->x + rect->width - 1) >> GRID_CELL_SHIFT;
+	e->cy2 = (rect->y + rect->height - 1) >> GRID_CELL_SHIFT;
+	e->large = (int64_t)(e->cx2 - e->cx1 + 1) *
+		(e->cy2 - e->cy1 + 1) > GRID_MAX_CELLS;
+
+	if (e->large) {
+		if (bucket_add(&g->large, id) < 0)
+			return -1;
+		e->present = true;
+		return 0;
+	}
+
+	for (int32_t cy = e->cy1; cy <= e->cy2; ++cy) {
+		for (int32_t cx = e->cx1; cx <= e->cx2; ++cx) {
+			if (bucket_add(get_bucket(g, cx, cy), id) < 0)
+				goto err;
+		}
+	}
+
+	e->present = true;
+	return 0;
+
+err:
+	/* Take it back out of the cells it did make it into */
+	e->present = true;
+	grid_remove(g, id);
+	return -1;
+}
+
+static bool
+rects_overlap(const struct rect *a, const struct rect *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+		a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/*
+ * Entries can be in a bucket several times, or in several of the buckets a
+ * query looks at, but should only be reported once per query.
+ */
+static void
+next_stamp(struct grid *g)
+{
+	if (++g->stamp == 0) {
+		for (uint32_t i = 0; i < g->entries_cap; ++i)
+			g->entries[i].stamp = 0;
+		g->stamp = 1;
+	}
+}
+
+static bool
+report_once(struct grid *g, uint32_t id, const struct rect *rect,
+	    grid_iter_fn fn, void *data)
+{
+	struct grid_entry *e = &g->entries[id];
+
+	if (e->stamp == g->stamp || !rects_overlap(&e->rect, rect))
+		return true;
+
+	e->stamp = g->stamp;
+	return fn(id, &e->rect, data);
+}
+
+void
+grid_query_point(struct grid *g, int32_t x, int32_t y,
+		 grid_iter_fn fn, void *data)
+{
+	struct grid_bucket *b = get_bucket(g, x >> GRID_CELL_SHIFT,
+					   y >> GRID_CELL_SHIFT);
+	struct rect point = { .x = x, .y = y, .width = 1, .height = 1 };
+
+	next_stamp(g);
+
+	for (uint32_t i = 0; i < b->len; ++i)
+		if (!report_once(g, b->ids[i], &point, fn, data))
+			return;
+
+	for (uint32_t i = 0; i < g->large.len; ++i)
+		if (!report_once(g, g->large.ids[i], &point, fn, data))
+			return;
+}
+
+void
+grid_query_rect(struct grid *g, const struct rect *rect,
+		grid_iter_fn fn, void *data)
+{
+	int32_t cx1, cy1, cx2, cy2;
+
+	if (rect->width <= 0 || rect->height <= 0)
+		return;
+
+	next_stamp(g);
+
+	cx1 = rect->x >> GRID_CELL_SHIFT;
+	cy1 = rect->y >> GRID_CELL_SHIFT;
+	cx2 = (rect->x + rect->width - 1) >> GRID_CELL_SHIFT;
+	cy2 = (rect->y + rect->height - 1) >> GRID_CELL_SHIFT;
+
+	if ((int64_t)(cx2 - cx1 + 1) * (cy2 - cy1 + 1) > GRID_BUCKETS) {
+		/* Every bucket would be visited anyway */
+		for (int i = 0; i < GRID_BUCKETS; ++i) {
+			struct grid_bucket *b = &g->buckets[i];
+
+			for (uint32_t j = 0; j < b->len; ++j)
+				if (!report_once(g, b->ids[j], rect, fn, data))
+					return;
+		}
+	} else {
+		for (int32_t cy = cy1; cy <= cy2; ++cy) {
+			for (int32_t cx = cx1; cx <= cx2; ++cx) {
+				struct grid_bucket *b = get_bucket(g, cx, cy);
+
+				for (uint32_t j = 0; j < b->len; ++j)
+					if (!report_once(g, b->ids[j], rect,
+							 fn, data))
+						return;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < g->large.len; ++i)
+		if (!report_once(g, g->large.ids[i], rect, fn, data))
+			return;
+}
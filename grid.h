@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef NORI_GRID_H
+#define NORI_GRID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "region.h"
+
+/*
+ * A uniform grid of rectangles keyed by id, for finding what's under a point
+ * without looking at everything. Cells are hashed into a fixed number of
+ * buckets, so the grid is unbounded and only costs memory for what's in it.
+ * Rectangles covering a lot of cells are kept on a separate list that's
+ * always checked instead.
+ */
+#define GRID_CELL_SHIFT 6 /* 64x64 cells */
+#define GRID_BUCKETS 4096
+#define GRID_MAX_CELLS 64
+
+struct grid_bucket {
+	uint32_t *ids;
+	uint32_t len;
+	uint32_t cap;
+};
+
+struct grid_entry {
+	struct rect rect;
+	/* Inclusive range of cells this entry was added to */
+	int32_t cx1, cy1, cx2, cy2;
+	bool present;
+	bool large;
+	/* Last query that reported this entry */
+	uint32_t stamp;
+};
+
+struct grid {
+	struct grid_bucket buckets[GRID_BUCKETS];
+	struct grid_bucket large;
+
+	/* Indexed by id */
+	struct grid_entry *entries;
+	uint32_t entries_cap;
+
+	uint32_t stamp;
+};
+
+/* Return false to stop iterating */
+typedef bool (*grid_iter_fn)(uint32_t id, const struct rect *rect, void *data);
+
+void
+grid_init(struct grid *g);
+void
+grid_finish(struct grid *g);
+
+/* Adds the id, or moves it if it's already there */
+int
+grid_insert(struct grid *g, uint32_t id, const struct rect *rect);
+void
+grid_remove(struct grid *g, uint32_t id);
+
+/*
+ * Both call fn once for every rectangle containing the point or overlapping
+ * the rectangle, in no particular order.
+ */
+void
+grid_query_point(struct grid *g, int32_t x, int32_t y,
+		 grid_iter_fn fn, void *data);
+void
+grid_query_rect(struct grid *g, const struct rect *rect,
+		grid_iter_fn fn, void *data);
+
+#endif
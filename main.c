@@ -47,12 +47,14 @@ timer_func(void *data)
 	struct timespec time;
 	uint32_t time_ms;
 	float pos;
+	int x, y;
 
 	clock_gettime(CLOCK_MONOTONIC, &time);
 	time_ms = timespec_to_msec(&time);
 	pos = (sinf(time_ms / 1000.0f) + 1.0f) * 50.0f;
 
-	scene_set_pos(top->root, top->root->base.x, pos);
+	scene_get_pos(top->root, &x, &y);
+	scene_set_pos(top->root, x, pos);
 
 	wl_event_source_timer_update(top->timer, 5);
 	wayland_surface_schedule_repaint(&top->base);
@@ -150,6 +152,9 @@ int main(void)
 	/* 26.6 fixed point format */
 	int32_t pen_26_6 = 0;
 
+	/* Every glyph is its own view, so add them all in one go */
+	scene_transaction_begin(top->scene);
+
 	for (const char *str = to_print; str <= to_print + to_print_len;) {
 		FcChar32 ucs = 0;
 		hb_script_t script = HB_SCRIPT_INVALID;
@@ -277,13 +282,13 @@ int main(void)
 			int32_t width = bitmap->width;
 			int32_t height = bitmap->rows;
 
-			struct scene_view *v = scene_view_create(width, height);
+			struct scene_view *v = scene_view_create(top->scene,
+								 width, height);
 			scene_push(top->root, v);
 			scene_set_pos(v, x, y);
 
-			v->texture = vulkan_texture_create(&vk, width, height,
-							   bitmap->pitch,
-							   bitmap->buffer);
+			scene_view_set_texture(v, vulkan_texture_create(&vk,
+				width, height, bitmap->pitch, bitmap->buffer));
 advance:
 			pen_26_6 += pos[i].x_advance;
 		}
@@ -306,6 +311,8 @@ add:
 		}
 	}
 
+	scene_transaction_commit(top->scene);
+
 	printf("===\n");
 
 	scene_dump(top->scene);
@@ -314,7 +321,9 @@ add:
 
 	top->timer = wl_event_loop_add_timer(ev, timer_func, top);
 	//wl_event_source_timer_update(top->timer, 5);
-	scene_set_pos(top->root, top->root->base.x, 80);
+	int root_x, root_y;
+	scene_get_pos(top->root, &root_x, &root_y);
+	scene_set_pos(top->root, root_x, 80);
 
 	wayland_surface_schedule_repaint(&top->base);
 	while (!wl.exit && !top->close)
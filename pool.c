@@ -0,0 +1,138 @@
+/* SPDX-License-Identifier: MIT */
+
+#define _POSIX_C_SOURCE 200809L
+#include "pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Shared between the workers and whoever started the job */
+static void
+pool_work(struct pool *p)
+{
+	for (;;) {
+		size_t start = atomic_fetch_add(&p->next, p->chunk);
+
+		if (start >= p->len)
+			return;
+
+		p->fn(p->data, start,
+		      start + p->chunk < p->len ? start + p->chunk : p->len);
+	}
+}
+
+static void *
+pool_thread(void *data)
+{
+	struct pool *p = data;
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&p->lock);
+
+	for (;;) {
+		while (p->job == seen && !p->quit)
+			pthread_cond_wait(&p->work_cond, &p->lock);
+		if (p->quit)
+			break;
+		seen = p->job;
+
+		pthread_mutex_unlock(&p->lock);
+		pool_work(p);
+		pthread_mutex_lock(&p->lock);
+
+		if (--p->busy == 0)
+			pthread_cond_signal(&p->done_cond);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+struct pool *
+pool_create(int num_threads)
+{
+	struct pool *p;
+	int err;
+
+	if (num_threads == 0)
+		num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (num_threads <= 0)
+		return NULL;
+
+	p = calloc(1, sizeof *p);
+	if (!p) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	p->threads = calloc(num_threads, sizeof *p->threads);
+	if (!p->threads) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		free(p);
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work_cond, NULL);
+	pthread_cond_init(&p->done_cond, NULL);
+	atomic_init(&p->next, 0);
+
+	for (int i = 0; i < num_threads; ++i) {
+		err = pthread_create(&p->threads[i], NULL, pool_thread, p);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			break;
+		}
+		++p->num_threads;
+	}
+
+	if (p->num_threads == 0) {
+		pool_destroy(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void
+pool_destroy(struct pool *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_broadcast(&p->work_cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 0; i < p->num_threads; ++i)
+		pthread_join(p->threads[i], NULL);
+
+	pthread_cond_destroy(&p->done_cond);
+	pthread_cond_destroy(&p->work_cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->threads);
+	free(p);
+}
+
+void
+pool_run(struct pool *p, pool_fn fn, void *data, size_t len, size_t chunk)
+{
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->data = data;
+	p->len = len;
+	p->chunk = chunk;
+	atomic_store(&p->next, 0);
+	p->busy = p->num_threads;
+	++p->job;
+	pthread_cond_broadcast(&p->work_cond);
+	pthread_mutex_unlock(&p->lock);
+
+	pool_work(p);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->busy > 0)
+		pthread_cond_wait(&p->done_cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
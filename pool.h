@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef NORI_POOL_H
+#define NORI_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Called with a range of whatever the job is working through */
+typedef void (*pool_fn)(void *data, size_t start, size_t end);
+
+/*
+ * Worker threads for splitting up loops whose iterations don't depend on
+ * each other. One job runs at a time, and the thread that started it helps
+ * out.
+ */
+struct pool {
+	pthread_t *threads;
+	int num_threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	/* The current job; set up under the lock before waking the workers */
+	pool_fn fn;
+	void *data;
+	size_t len;
+	size_t chunk;
+	/* Bumped for every job, so workers know there's a new one */
+	uint64_t job;
+	/* Workers still going at the current job */
+	int busy;
+	bool quit;
+
+	/* Start of the next chunk to hand out */
+	atomic_size_t next;
+};
+
+/* With 0 threads, uses one less than there are CPUs. NULL if that's none. */
+struct pool *
+pool_create(int num_threads);
+void
+pool_destroy(struct pool *p);
+
+/* Calls fn on [0, len) in chunks, and returns once they're all done */
+void
+pool_run(struct pool *p, pool_fn fn, void *data, size_t len, size_t chunk);
+
+#endif
@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Times each quad writer this CPU can run, with the slots in order and
+ * then shuffled, and checks they all write the same thing.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "quad.h"
+
+#define NUM_QUADS (1 << 20)
+#define NUM_RUNS 20
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static float
+random_float(float max)
+{
+	return (float)rand() / RAND_MAX * max;
+}
+
+static void
+run(quad_write_fn write, struct quad *quads,
+    const struct quad_batch *batches, size_t num_batches)
+{
+	for (size_t i = 0; i < num_batches; ++i)
+		write(quads, &batches[i]);
+}
+
+static int
+bench(const char *label, const struct quad_writer *writers,
+      size_t num_writers, struct quad_batch *batches, size_t num_batches,
+      const int *slots, struct quad *expected, struct quad *quads)
+{
+	int ret = 0;
+
+	srand(1);
+	for (size_t i = 0; i < num_batches; ++i) {
+		struct quad_batch *b = &batches[i];
+
+		for (size_t j = 0; j < QUAD_BATCH; ++j) {
+			b->x[j] = random_float(4096.0f);
+			b->y[j] = random_float(4096.0f);
+			b->xx[j] = random_float(2.0f) - 1.0f;
+			b->xy[j] = random_float(2.0f) - 1.0f;
+			b->yx[j] = random_float(2.0f) - 1.0f;
+			b->yy[j] = random_float(2.0f) - 1.0f;
+			b->width[j] = random_float(512.0f);
+			b->height[j] = random_float(512.0f);
+			b->slots[j] = slots[i * QUAD_BATCH + j];
+		}
+		b->len = QUAD_BATCH;
+	}
+
+	/* The first one is always the scalar version */
+	run(writers[0].write, expected, batches, num_batches);
+
+	printf("%s:\n", label);
+	for (size_t i = 0; i < num_writers; ++i) {
+		double start, best = 0.0;
+
+		memset(quads, 0, NUM_QUADS * sizeof *quads);
+		run(writers[i].write, quads, batches, num_batches);
+		if (memcmp(quads, expected, NUM_QUADS * sizeof *quads) != 0) {
+			fprintf(stderr, "%s: doesn't match scalar\n",
+				writers[i].name);
+			ret = -1;
+		}
+
+		for (int j = 0; j < NUM_RUNS; ++j) {
+			double t;
+
+			start = now();
+			run(writers[i].write, quads, batches, num_batches);
+			t = now() - start;
+			if (j == 0 || t < best)
+				best = t;
+		}
+
+		printf("  %-8s %6.2f ns/quad\n", writers[i].name,
+		       best * 1e9 / NUM_QUADS);
+	}
+
+	return ret;
+}
+
+int
+main(void)
+{
+	size_t num_batches = NUM_QUADS / QUAD_BATCH;
+	struct quad_batch *batches = calloc(num_batches, sizeof *batches);
+	struct quad *expected = calloc(NUM_QUADS, sizeof *expected);
+	struct quad *quads = calloc(NUM_QUADS, sizeof *quads);
+	int *slots = calloc(NUM_QUADS, sizeof *slots);
+	struct quad_writer writers[QUAD_MAX_WRITERS];
+	size_t num_writers;
+	int ret = 0;
+
+	if (!batches || !expected || !quads || !slots) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return 1;
+	}
+
+	num_writers = quad_get_writers(writers);
+
+	for (int i = 0; i < NUM_QUADS; ++i)
+		slots[i] = i;
+	if (bench("in order", writers, num_writers, batches, num_batches,
+		  slots, expected, quads) < 0)
+		ret = 1;
+
+	/* Slots end up scattered, like after views come and go */
+	for (int i = NUM_QUADS - 1; i > 0; --i) {
+		int j = rand() % (i + 1);
+		int tmp = slots[i];
+
+		slots[i] = slots[j];
+		slots[j] = tmp;
+	}
+	if (bench("shuffled", writers, num_writers, batches, num_batches,
+		  slots, expected, quads) < 0)
+		ret = 1;
+
+	free(batches);
+	free(expected);
+	free(quads);
+	free(slots);
+
+	return ret;
+}
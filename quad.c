@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "quad.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define QUAD_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Each edge is one multiply per component, with nothing added, so every
+ * version rounds the same way and gives the same results.
+ */
+static void
+quad_write_one(struct quad *quads, const struct quad_batch *b, size_t i)
+{
+	quads[b->slots[i]] = (struct quad) {
+		.x = b->x[i],
+		.y = b->y[i],
+		.across_x = b->xx[i] * b->width[i],
+		.across_y = b->yx[i] * b->width[i],
+		.down_x = b->xy[i] * b->height[i],
+		.down_y = b->yy[i] * b->height[i],
+	};
+}
+
+static void
+quad_write_scalar(struct quad *quads, const struct quad_batch *b)
+{
+	for (size_t i = 0; i < b->len; ++i)
+		quad_write_one(quads, b, i);
+}
+
+#ifdef QUAD_X86
+/*
+ * Turns four quads' worth of arrays around into four quads. The first four
+ * floats of each go in one store, and the down edges in half of one.
+ */
+__attribute__((target("sse2")))
+static inline void
+quad_store_sse2(struct quad *quads, const int *slots,
+		__m128 x, __m128 y, __m128 ax, __m128 ay,
+		__m128 dx, __m128 dy)
+{
+	__m128 lo, hi;
+
+	_MM_TRANSPOSE4_PS(x, y, ax, ay);
+	_mm_storeu_ps(&quads[slots[0]].x, x);
+	_mm_storeu_ps(&quads[slots[1]].x, y);
+	_mm_storeu_ps(&quads[slots[2]].x, ax);
+	_mm_storeu_ps(&quads[slots[3]].x, ay);
+
+	lo = _mm_unpacklo_ps(dx, dy);
+	hi = _mm_unpackhi_ps(dx, dy);
+	_mm_storel_pi((__m64 *)&quads[slots[0]].down_x, lo);
+	_mm_storeh_pi((__m64 *)&quads[slots[1]].down_x, lo);
+	_mm_storel_pi((__m64 *)&quads[slots[2]].down_x, hi);
+	_mm_storeh_pi((__m64 *)&quads[slots[3]].down_x, hi);
+}
+
+__attribute__((target("sse2")))
+static void
+quad_write_sse2(struct quad *quads, const struct quad_batch *b)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= b->len; i += 4) {
+		__m128 w = _mm_loadu_ps(&b->width[i]);
+		__m128 h = _mm_loadu_ps(&b->height[i]);
+
+		quad_store_sse2(quads, &b->slots[i],
+				_mm_loadu_ps(&b->x[i]),
+				_mm_loadu_ps(&b->y[i]),
+				_mm_mul_ps(_mm_loadu_ps(&b->xx[i]), w),
+				_mm_mul_ps(_mm_loadu_ps(&b->yx[i]), w),
+				_mm_mul_ps(_mm_loadu_ps(&b->xy[i]), h),
+				_mm_mul_ps(_mm_loadu_ps(&b->yy[i]), h));
+	}
+
+	for (; i < b->len; ++i)
+		quad_write_one(quads, b, i);
+}
+
+/* Eight at a time, stored as two groups of four */
+__attribute__((target("avx2")))
+static void
+quad_write_avx2(struct quad *quads, const struct quad_batch *b)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= b->len; i += 8) {
+		__m256 w = _mm256_loadu_ps(&b->width[i]);
+		__m256 h = _mm256_loadu_ps(&b->height[i]);
+		__m256 x = _mm256_loadu_ps(&b->x[i]);
+		__m256 y = _mm256_loadu_ps(&b->y[i]);
+		__m256 ax = _mm256_mul_ps(_mm256_loadu_ps(&b->xx[i]), w);
+		__m256 ay = _mm256_mul_ps(_mm256_loadu_ps(&b->yx[i]), w);
+		__m256 dx = _mm256_mul_ps(_mm256_loadu_ps(&b->xy[i]), h);
+		__m256 dy = _mm256_mul_ps(_mm256_loadu_ps(&b->yy[i]), h);
+
+		quad_store_sse2(quads, &b->slots[i],
+				_mm256_castps256_ps128(x),
+				_mm256_castps256_ps128(y),
+				_mm256_castps256_ps128(ax),
+				_mm256_castps256_ps128(ay),
+				_mm256_castps256_ps128(dx),
+				_mm256_castps256_ps128(dy));
+		quad_store_sse2(quads, &b->slots[i + 4],
+				_mm256_extractf128_ps(x, 1),
+				_mm256_extractf128_ps(y, 1),
+				_mm256_extractf128_ps(ax, 1),
+				_mm256_extractf128_ps(ay, 1),
+				_mm256_extractf128_ps(dx, 1),
+				_mm256_extractf128_ps(dy, 1));
+	}
+
+	for (; i < b->len; ++i)
+		quad_write_one(quads, b, i);
+}
+#endif
+
+size_t
+quad_get_writers(struct quad_writer writers[QUAD_MAX_WRITERS])
+{
+	size_t len = 0;
+
+	writers[len++] = (struct quad_writer) { "scalar", quad_write_scalar };
+#ifdef QUAD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		writers[len++] = (struct quad_writer) { "sse2", quad_write_sse2 };
+	if (__builtin_cpu_supports("avx2"))
+		writers[len++] = (struct quad_writer) { "avx2", quad_write_avx2 };
+#endif
+
+	return len;
+}
+
+quad_write_fn
+quad_get_writer(void)
+{
+	struct quad_writer writers[QUAD_MAX_WRITERS];
+
+	quad_get_writers(writers);
+	return writers[0].write;
+}
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef NORI_QUAD_H
+#define NORI_QUAD_H
+
+#include <stddef.h>
+
+/*
+ * A parallelogram, as its top left corner and the vectors along its top
+ * and left edges. shader.vert expands these into two triangles.
+ */
+struct quad {
+	float x, y;
+	float across_x, across_y;
+	float down_x, down_y;
+};
+
+#define QUAD_BATCH 64
+
+/*
+ * Up to QUAD_BATCH quads waiting to be written, one array per input so the
+ * writers can work on several at a time. Each is a width by height
+ * rectangle put through the transform (xx, xy, yx, yy, x, y), and goes to
+ * its slot.
+ */
+struct quad_batch {
+	float x[QUAD_BATCH];
+	float y[QUAD_BATCH];
+	float xx[QUAD_BATCH];
+	float xy[QUAD_BATCH];
+	float yx[QUAD_BATCH];
+	float yy[QUAD_BATCH];
+	float width[QUAD_BATCH];
+	float height[QUAD_BATCH];
+	int slots[QUAD_BATCH];
+	size_t len;
+};
+
+typedef void (*quad_write_fn)(struct quad *quads,
+			      const struct quad_batch *batch);
+
+struct quad_writer {
+	const char *name;
+	quad_write_fn write;
+};
+
+#define QUAD_MAX_WRITERS 3
+
+/*
+ * Every version this CPU can run, the one quad_get_writer() picks first,
+ * returning how many there are. They all give exactly the same results.
+ *
+ * quad-bench puts the SIMD versions 5-15% ahead when the slots come in
+ * order and 5-10% behind when they're shuffled, where the scattered stores
+ * cost more than the multiplies. Scene slots get shuffled as views
+ * come and go, so scalar is the default; the others stay so quad-bench can
+ * keep checking that, and are kept bit-exact with it.
+ */
+size_t
+quad_get_writers(struct quad_writer writers[QUAD_MAX_WRITERS]);
+
+/* The version the scene uses */
+quad_write_fn
+quad_get_writer(void);
+
+#endif
@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "region.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void
+region_init(struct region *r)
+{
+	r->num_rects = 0;
+}
+
+static bool
+rect_contains(const struct rect *a, const struct rect *b)
+{
+	return b->x >= a->x && b->y >= a->y &&
+		b->x + b->width <= a->x + a->width &&
+		b->y + b->height <= a->y + a->height;
+}
+
+static void
+rect_union(struct rect *out, const struct rect *a, const struct rect *b)
+{
+	int32_t x1 = a->x < b->x ? a->x : b->x;
+	int32_t y1 = a->y < b->y ? a->y : b->y;
+	int32_t x2 = a->x + a->width > b->x + b->width ?
+		a->x + a->width : b->x + b->width;
+	int32_t y2 = a->y + a->height > b->y + b->height ?
+		a->y + a->height : b->y + b->height;
+
+	out->x = x1;
+	out->y = y1;
+	out->width = x2 - x1;
+	out->height = y2 - y1;
+}
+
+static int64_t
+rect_area(const struct rect *r)
+{
+	return (int64_t)r->width * r->height;
+}
+
+static void
+region_remove(struct region *r, int i)
+{
+	r->rects[i] = r->rects[--r->num_rects];
+}
+
+void
+region_add_rect(struct region *r, int32_t x, int32_t y,
+		int32_t width, int32_t height)
+{
+	struct rect new = {
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+	};
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	for (int i = 0; i < r->num_rects;) {
+		if (rect_contains(&r->rects[i], &new))
+			return;
+
+		/* Anything we cover completely is redundant */
+		if (rect_contains(&new, &r->rects[i]))
+			region_remove(r, i);
+		else
+			++i;
+	}
+
+	if (r->num_rects < REGION_MAX_RECTS) {
+		r->rects[r->num_rects++] = new;
+		return;
+	}
+
+	/*
+	 * Out of space. Merge with whichever rectangle grows the least,
+	 * then keep merging in case the result now swallows others.
+	 */
+	int best = 0;
+	int64_t best_cost = INT64_MAX;
+
+	for (int i = 0; i < r->num_rects; ++i) {
+		struct rect u;
+		int64_t cost;
+
+		rect_union(&u, &r->rects[i], &new);
+		cost = rect_area(&u) - rect_area(&r->rects[i]);
+		if (cost < best_cost) {
+			best = i;
+			best_cost = cost;
+		}
+	}
+
+	rect_union(&new, &r->rects[best], &new);
+	region_remove(r, best);
+	region_add_rect(r, new.x, new.y, new.width, new.height);
+}
+
+void
+region_union(struct region *dst, const struct region *src)
+{
+	for (int i = 0; i < src->num_rects; ++i) {
+		const struct rect *b = &src->rects[i];
+		region_add_rect(dst, b->x, b->y, b->width, b->height);
+	}
+}
+
+void
+region_intersect_rect(struct region *r, int32_t x, int32_t y,
+		      int32_t width, int32_t height)
+{
+	for (int i = 0; i < r->num_rects;) {
+		struct rect *b = &r->rects[i];
+		int32_t x1 = b->x > x ? b->x : x;
+		int32_t y1 = b->y > y ? b->y : y;
+		int32_t x2 = b->x + b->width < x + width ?
+			b->x + b->width : x + width;
+		int32_t y2 = b->y + b->height < y + height ?
+			b->y + b->height : y + height;
+
+		if (x2 <= x1 || y2 <= y1) {
+			region_remove(r, i);
+			continue;
+		}
+
+		*b = (struct rect) {
+			.x = x1,
+			.y = y1,
+			.width = x2 - x1,
+			.height = y2 - y1,
+		};
+		++i;
+	}
+}
+
+void
+region_extents(const struct region *r, struct rect *out)
+{
+	if (r->num_rects == 0) {
+		*out = (struct rect) { 0 };
+		return;
+	}
+
+	*out = r->rects[0];
+	for (int i = 1; i < r->num_rects; ++i)
+		rect_union(out, out, &r->rects[i]);
+}
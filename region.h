@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef NORI_REGION_H
+#define NORI_REGION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A deliberately simple region: a short list of possibly overlapping
+ * rectangles. Once it runs out of space, rectangles get merged together,
+ * so the region may grow to cover more than what was added, but never less.
+ * That's fine for damage tracking, where over-estimating only costs a bit of
+ * extra drawing.
+ */
+#define REGION_MAX_RECTS 16
+
+struct rect {
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+struct region {
+	int num_rects;
+	struct rect rects[REGION_MAX_RECTS];
+};
+
+void
+region_init(struct region *r);
+
+static inline void
+region_clear(struct region *r)
+{
+	r->num_rects = 0;
+}
+
+static inline bool
+region_is_empty(const struct region *r)
+{
+	return r->num_rects == 0;
+}
+
+void
+region_add_rect(struct region *r, int32_t x, int32_t y,
+		int32_t width, int32_t height);
+
+void
+region_union(struct region *dst, const struct region *src);
+
+void
+region_intersect_rect(struct region *r, int32_t x, int32_t y,
+		      int32_t width, int32_t height);
+
+void
+region_extents(const struct region *r, struct rect *out);
+
+#endif
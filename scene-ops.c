@@ -3,82 +3,655 @@
 #include "scene.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
-#include <wayland-util.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "region.h"
+
+/* Whether the node is part of what the scene draws, going from scratch */
+static bool
+node_is_attached(struct scene *s, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	for (uint32_t p = n->parent[id]; p != SCENE_NONE; p = n->parent[p])
+		id = p;
+
+	return id == s->root;
+}
+
+static int
+id_list_add(uint32_t **list, uint32_t *len, uint32_t *cap, uint32_t id)
+{
+	if (*len == *cap) {
+		uint32_t new_cap = *cap ? *cap * 2 : 64;
+		uint32_t *ids = realloc(*list, new_cap * sizeof *ids);
+		if (!ids) {
+			fprintf(stderr, "realloc: %s\n", strerror(errno));
+			return -1;
+		}
+
+		*list = ids;
+		*cap = new_cap;
+	}
+
+	(*list)[(*len)++] = id;
+	return 0;
+}
+
+/*
+ * Adds delta to the parent's view count, leaving its ancestors for the
+ * transaction commit. False if that's not possible, and the ancestors need
+ * updating now.
+ */
+static bool
+node_defer_count(struct scene *s, uint32_t parent, int32_t delta)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	if (s->transaction == 0)
+		return false;
+
+	if (!(n->flags[parent] & SCENE_NODE_COUNT_PENDING)) {
+		if (id_list_add(&s->pending_counts, &s->num_pending_counts,
+				&s->pending_counts_cap, parent) < 0)
+			return false;
+		n->flags[parent] |= SCENE_NODE_COUNT_PENDING;
+	}
+
+	n->decendent_views[parent] += delta;
+	n->views_delta[parent] += delta;
+	return true;
+}
+
+/*
+ * How many of the node's views its ancestors know about. Any pending delta
+ * hasn't reached them yet, and gets there through whichever parent the node
+ * has at the commit.
+ */
+static uint32_t
+node_seen_views(struct scene *s, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	if (n->flags[id] & SCENE_NODE_COUNT_PENDING)
+		return n->decendent_views[id] - n->views_delta[id];
+
+	return n->decendent_views[id];
+}
+
+static int
+scene_alloc_slot(struct scene *s)
+{
+	if (s->num_free_slots > 0)
+		return s->free_slots[--s->num_free_slots];
+
+	if (s->num_slots == s->slots_cap) {
+		int cap = s->slots_cap ? s->slots_cap * 2 : 64;
+		struct quad *quads = realloc(s->quads,
+					     (size_t)cap * sizeof *quads);
+		if (!quads) {
+			fprintf(stderr, "realloc: %s\n", strerror(errno));
+			return -1;
+		}
+
+		s->quads = quads;
+		s->slots_cap = cap;
+	}
+
+	return s->num_slots++;
+}
 
 static void
-node_disconnect(struct scene_node *n)
+scene_free_slot(struct scene *s, int slot)
 {
-	wl_list_remove(&n->link);
-	wl_list_init(&n->link);
+	if (s->num_free_slots == s->free_slots_cap) {
+		int cap = s->free_slots_cap ? s->free_slots_cap * 2 : 64;
+		int *slots = realloc(s->free_slots, cap * sizeof *slots);
+		if (!slots) {
+			/* Just leak the slot */
+			fprintf(stderr, "realloc: %s\n", strerror(errno));
+			return;
+		}
 
-	for (struct scene_layer *p = n->parent; p; p = p->base.parent) {
-		assert(p->base.decendent_views >= n->decendent_views);
-		p->base.decendent_views -= n->decendent_views;
+		s->free_slots = slots;
+		s->free_slots_cap = cap;
 	}
 
-	n->parent = NULL;
+	s->free_slots[s->num_free_slots++] = slot;
+}
+
+/* Gives every view in the subtree a place in the scene's vertex data */
+static void
+node_alloc_slots(struct scene *s, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	switch (n->type[id]) {
+	case SCENE_NODE_LAYER:
+		for (uint32_t c = n->first_child[id]; c != SCENE_NONE;
+		     c = n->next[c])
+			node_alloc_slots(s, c);
+
+		if ((n->flags[id] & SCENE_NODE_CACHED) && n->slot[id] < 0)
+			n->slot[id] = scene_alloc_slot(s);
+		break;
+	case SCENE_NODE_VIEW:
+		/* Whatever's in a recycled slot belongs to some other view */
+		if (n->slot[id] < 0) {
+			n->slot[id] = scene_alloc_slot(s);
+			n->flags[id] |= SCENE_NODE_STALE;
+		}
+		break;
+	}
 }
 
+/* Views not in the scene can't be picked either */
 static void
-node_set_parent(struct scene_layer *p, struct scene_node *n)
+node_free_slots(struct scene *s, uint32_t id)
 {
-	n->parent = p;
-	p->base.decendent_views += n->decendent_views;
+	struct scene_nodes *n = &s->nodes;
+
+	switch (n->type[id]) {
+	case SCENE_NODE_LAYER:
+		for (uint32_t c = n->first_child[id]; c != SCENE_NONE;
+		     c = n->next[c])
+			node_free_slots(s, c);
+
+		if (n->slot[id] >= 0)
+			scene_free_slot(s, n->slot[id]);
+		n->slot[id] = -1;
+		break;
+	case SCENE_NODE_VIEW:
+		if (n->slot[id] >= 0)
+			scene_free_slot(s, n->slot[id]);
+		n->slot[id] = -1;
+		grid_remove(&s->grid, id);
+		break;
+	}
+}
+
+/* Whether the node was attached as of the last scene_update */
+static bool
+node_in_order(struct scene *s, uint32_t id)
+{
+	uint32_t i = id < s->order_cap ? s->order_index[id] : SCENE_NONE;
+
+	return i < s->order_len && s->order[i] == id;
+}
+
+/*
+ * Once we get to a parent which is already marked, so is everything above
+ * it, and any caches up there have already been invalidated.
+ */
+static void
+node_mark_ancestors(struct scene *s, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	for (uint32_t p = n->parent[id];
+	     p != SCENE_NONE && !(n->flags[p] & SCENE_NODE_CHILD_DIRTY);
+	     p = n->parent[p]) {
+		n->flags[p] |= SCENE_NODE_CHILD_DIRTY;
+		n->flags[p] &= ~SCENE_NODE_CACHE_VALID;
+	}
+}
+
+/*
+ * The transaction version of node_damage. Clean nodes still have the bounds
+ * they were last drawn with, so that's what gets damaged now. Dirty ones
+ * had their current area damaged when they became dirty. Everything else
+ * waits for the commit.
+ */
+static bool
+node_defer_damage(struct scene *s, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+	const struct rect *box = &n->bounds[id];
+
+	if (s->transaction == 0)
+		return false;
+
+	if (n->flags[id] & SCENE_NODE_PENDING)
+		return true;
+
+	if (id_list_add(&s->pending, &s->num_pending, &s->pending_cap, id) < 0)
+		return false;
+
+	if (!(n->flags[id] & SCENE_NODE_DIRTY))
+		region_add_rect(&s->damage, box->x, box->y,
+				box->width, box->height);
+
+	n->flags[id] |= SCENE_NODE_DIRTY | SCENE_NODE_PENDING;
+	return true;
+}
+
+/*
+ * Marks the node as changed, before changing it. Clean nodes still have the
+ * bounds they were last drawn with, so that's what gets damaged; wherever
+ * they end up gets damaged by scene_update. Any cached layers it's inside
+ * of will need redrawing; the node's own cache doesn't care where it is.
+ */
+static void
+node_damage(struct scene *s, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+	const struct rect *box = &n->bounds[id];
+
+	if (node_defer_damage(s, id))
+		return;
+
+	/* Linking it in dirties the order, and it isn't in there yet */
+	if (node_in_order(s, id) || s->order_dirty)
+		++s->generation;
+
+	if (!(n->flags[id] & SCENE_NODE_DIRTY) && node_in_order(s, id))
+		region_add_rect(&s->damage, box->x, box->y,
+				box->width, box->height);
+
+	n->flags[id] |= SCENE_NODE_DIRTY;
+	for (uint32_t p = n->parent[id];
+	     p != SCENE_NONE && !(n->flags[p] & SCENE_NODE_CHILD_DIRTY);
+	     p = n->parent[p])
+		n->flags[p] |= SCENE_NODE_CHILD_DIRTY;
+
+	for (uint32_t p = n->parent[id]; p != SCENE_NONE; p = n->parent[p])
+		n->flags[p] &= ~SCENE_NODE_CACHE_VALID;
+}
+
+/* Should be called once the node has been linked into its new place */
+static void
+node_connected(struct scene *s, uint32_t id)
+{
+	/* Slots are handed out at the commit, once we know where it ended up */
+	if (node_defer_damage(s, id)) {
+		s->order_dirty = true;
+		return;
+	}
+
+	if (node_is_attached(s, id)) {
+		node_alloc_slots(s, id);
+		s->order_dirty = true;
+	}
+
+	node_damage(s, id);
+}
+
+static void
+node_disconnect(struct scene *s, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+	uint32_t parent = n->parent[id];
+
+	/* Nodes outside of the scene don't have any slots to free */
+	if (s->transaction > 0 || node_is_attached(s, id)) {
+		/* Orphans give theirs back in scene_update */
+		if (!(n->flags[id] & SCENE_NODE_ORPHAN))
+			node_free_slots(s, id);
+		s->order_dirty = true;
+	}
+
+	node_damage(s, id);
+
+	/*
+	 * The commit only gets to see where the node ended up, so whatever it
+	 * leaves behind has to be told now.
+	 */
+	if (s->transaction > 0)
+		node_mark_ancestors(s, id);
+
+	if (s->root == id)
+		s->root = SCENE_NONE;
+
+	if (parent == SCENE_NONE)
+		return;
+
+	if (n->prev[id] != SCENE_NONE)
+		n->next[n->prev[id]] = n->next[id];
+	else
+		n->first_child[parent] = n->next[id];
+
+	if (n->next[id] != SCENE_NONE)
+		n->prev[n->next[id]] = n->prev[id];
+	else
+		n->last_child[parent] = n->prev[id];
+
+	uint32_t views = node_seen_views(s, id);
+	if (!node_defer_count(s, parent, -(int32_t)views)) {
+		for (uint32_t p = parent; p != SCENE_NONE; p = n->parent[p]) {
+			assert(n->decendent_views[p] >= views);
+			n->decendent_views[p] -= views;
+		}
+	}
+
+	n->parent[id] = SCENE_NONE;
+	n->prev[id] = SCENE_NONE;
+	n->next[id] = SCENE_NONE;
+}
+
+/* Links the node into the parent's children, between prev and next */
+static void
+node_link(struct scene *s, uint32_t parent, uint32_t prev, uint32_t next,
+	  uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	n->parent[id] = parent;
+	n->prev[id] = prev;
+	n->next[id] = next;
+
+	if (prev != SCENE_NONE)
+		n->next[prev] = id;
+	else
+		n->first_child[parent] = id;
+
+	if (next != SCENE_NONE)
+		n->prev[next] = id;
+	else
+		n->last_child[parent] = id;
+
+	uint32_t views = node_seen_views(s, id);
+	if (node_defer_count(s, parent, views))
+		return;
+
+	for (uint32_t p = parent; p != SCENE_NONE; p = n->parent[p])
+		n->decendent_views[p] += views;
 }
 
 static void
 node_set_root(struct scene *s, struct scene_node *n)
 {
-	node_disconnect(n);
-	s->root = n;
+	assert(n->scene == s);
+
+	if (s->root == n->id)
+		return;
+
+	if (s->root != SCENE_NONE)
+		node_disconnect(s, s->root);
+
+	node_disconnect(s, n->id);
+	s->root = n->id;
+
+	node_connected(s, n->id);
 }
 
 static void
 node_push(struct scene_layer *parent, struct scene_node *n)
 {
-	node_disconnect(n);
-	node_set_parent(parent, n);
-	wl_list_insert(parent->children.prev, &n->link);
+	struct scene *s = n->scene;
+	uint32_t p = parent->base.id;
+
+	assert(parent->base.scene == s);
+
+	node_disconnect(s, n->id);
+	node_link(s, p, s->nodes.last_child[p], SCENE_NONE, n->id);
+	node_connected(s, n->id);
 }
 
 static void
 node_above(struct scene_node *rel, struct scene_node *n)
 {
-	assert(rel->parent);
+	struct scene *s = n->scene;
+
+	assert(rel->scene == s);
+	assert(s->nodes.parent[rel->id] != SCENE_NONE);
 
-	node_disconnect(n);
-	node_set_parent(rel->parent, n);
-	wl_list_insert(&rel->link, &n->link);
+	node_disconnect(s, n->id);
+	node_link(s, s->nodes.parent[rel->id], rel->id,
+		  s->nodes.next[rel->id], n->id);
+	node_connected(s, n->id);
 }
 
 static void
 node_below(struct scene_node *rel, struct scene_node *n)
 {
-	assert(rel->parent);
+	struct scene *s = n->scene;
 
-	node_disconnect(n);
-	node_set_parent(rel->parent, n);
-	wl_list_insert(rel->link.prev, &n->link);
+	assert(rel->scene == s);
+	assert(s->nodes.parent[rel->id] != SCENE_NONE);
+
+	node_disconnect(s, n->id);
+	node_link(s, s->nodes.parent[rel->id], s->nodes.prev[rel->id],
+		  rel->id, n->id);
+	node_connected(s, n->id);
 }
 
 static void
 node_set_pos(struct scene_node *n, int x, int y)
 {
-	n->x = x;
-	n->y = y;
+	struct scene *s = n->scene;
+	struct scene_nodes *nodes = &s->nodes;
+
+	if (nodes->x[n->id] == x && nodes->y[n->id] == y)
+		return;
+
+	node_damage(s, n->id);
+	nodes->x[n->id] = x;
+	nodes->y[n->id] = y;
+}
+
+static void
+node_set_scale(struct scene_node *n, float scale)
+{
+	struct scene *s = n->scene;
+	struct scene_nodes *nodes = &s->nodes;
+
+	if (nodes->scale[n->id] == scale)
+		return;
+
+	node_damage(s, n->id);
+	nodes->scale[n->id] = scale;
+}
+
+static void
+node_set_rotation(struct scene_node *n, float rotation)
+{
+	struct scene *s = n->scene;
+	struct scene_nodes *nodes = &s->nodes;
+
+	if (nodes->rotation[n->id] == rotation)
+		return;
+
+	node_damage(s, n->id);
+	nodes->rotation[n->id] = rotation;
+}
+
+/* Doesn't move anything, so the damage stays the same */
+static void
+node_set_opacity(struct scene_node *n, float opacity)
+{
+	struct scene *s = n->scene;
+	struct scene_nodes *nodes = &s->nodes;
+
+	if (opacity < 0.0f)
+		opacity = 0.0f;
+	if (opacity > 1.0f)
+		opacity = 1.0f;
+
+	if (nodes->opacity[n->id] == opacity)
+		return;
+
+	nodes->opacity[n->id] = opacity;
+	node_damage(s, n->id);
+}
+
+void
+scene_free_orphans(struct scene *s)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	for (uint32_t i = 0; i < s->num_orphans; ++i) {
+		uint32_t id = s->orphans[i];
+
+		n->flags[id] &= ~SCENE_NODE_ORPHAN;
+		node_free_slots(s, id);
+	}
+
+	s->num_orphans = 0;
+}
+
+/*
+ * Only the node itself goes on the free list; see nodes_reuse for what
+ * happens to its children. Their slots are left for scene_free_orphans,
+ * so this doesn't have to visit them, unless there's no room to remember
+ * the node.
+ */
+static void
+node_destroy(struct scene *s, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	if ((s->transaction > 0 || node_is_attached(s, id)) &&
+	    id_list_add(&s->orphans, &s->num_orphans, &s->orphans_cap,
+			id) == 0)
+		n->flags[id] |= SCENE_NODE_ORPHAN;
+
+	node_disconnect(s, id);
+	scene_layer_drop_cache(s, id);
+
+	n->next[id] = n->free;
+	n->free = id;
+}
+
+void
+scene_transaction_begin(struct scene *s)
+{
+	++s->transaction;
+}
+
+/*
+ * Passes view count changes on to the ancestors. Whenever one of them has
+ * changes of its own to pass on, we can stop and let it take ours along.
+ */
+static void
+flush_counts(struct scene *s)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	for (uint32_t i = 0; i < s->num_pending_counts; ++i) {
+		uint32_t id = s->pending_counts[i];
+		int32_t delta = n->views_delta[id];
+
+		/* Already done, or reused since */
+		if (!(n->flags[id] & SCENE_NODE_COUNT_PENDING))
+			continue;
+
+		n->flags[id] &= ~SCENE_NODE_COUNT_PENDING;
+		n->views_delta[id] = 0;
+
+		for (uint32_t p = n->parent[id]; p != SCENE_NONE && delta != 0;
+		     p = n->parent[p]) {
+			n->decendent_views[p] += delta;
+
+			if (n->flags[p] & SCENE_NODE_COUNT_PENDING) {
+				n->views_delta[p] += delta;
+				break;
+			}
+		}
+	}
+
+	s->num_pending_counts = 0;
+}
+
+void
+scene_transaction_commit(struct scene *s)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	assert(s->transaction > 0);
+	if (--s->transaction > 0)
+		return;
+
+	flush_counts(s);
+
+	for (uint32_t i = 0; i < s->num_pending; ++i)
+		node_mark_ancestors(s, s->pending[i]);
+
+	/* Now the bounds say where everything ended up */
+	scene_update(s);
+
+	for (uint32_t i = 0; i < s->num_pending; ++i) {
+		uint32_t id = s->pending[i];
+		const struct rect *box = &n->bounds[id];
+
+		/* Already done, or reused since */
+		if (!(n->flags[id] & SCENE_NODE_PENDING))
+			continue;
+		n->flags[id] &= ~SCENE_NODE_PENDING;
+
+		if (!node_in_order(s, id))
+			continue;
+
+		node_alloc_slots(s, id);
+		region_add_rect(&s->damage, box->x, box->y,
+				box->width, box->height);
+	}
+
+	if (s->num_pending > 0)
+		++s->generation;
+	s->num_pending = 0;
+
+	scene_publish(s);
+}
+
+void
+scene_apply_op(struct scene *s, const struct scene_op *op)
+{
+	struct scene_nodes *n = &s->nodes;
+	struct scene_node *node = op->node;
+
+	assert(node->scene == s);
+
+	switch (op->type) {
+	case SCENE_OP_PUSH:
+		assert(n->type[op->rel->id] == SCENE_NODE_LAYER);
+		node_push((struct scene_layer *)op->rel, node);
+		break;
+	case SCENE_OP_ABOVE:
+		node_above(op->rel, node);
+		break;
+	case SCENE_OP_BELOW:
+		node_below(op->rel, node);
+		break;
+	case SCENE_OP_SET_POS:
+		node_set_pos(node, op->pos.x, op->pos.y);
+		break;
+	case SCENE_OP_DISCONNECT:
+		node_disconnect(s, node->id);
+		break;
+	case SCENE_OP_SET_TEXTURE:
+		assert(n->type[node->id] == SCENE_NODE_VIEW);
+		scene_view_set_texture((struct scene_view *)node, op->texture);
+		break;
+	}
 }
 
 void
 scene_disconnect_view(struct scene_view *v)
 {
-	node_disconnect(&v->base);
+	node_disconnect(v->base.scene, v->base.id);
 }
 
 void
 scene_disconnect_layer(struct scene_layer *l)
 {
-	node_disconnect(&l->base);
+	node_disconnect(l->base.scene, l->base.id);
+}
+
+void
+scene_view_destroy(struct scene_view *v)
+{
+	node_destroy(v->base.scene, v->base.id);
+}
+
+void
+scene_layer_destroy(struct scene_layer *l)
+{
+	node_destroy(l->base.scene, l->base.id);
 }
 
 void
@@ -164,3 +737,94 @@ scene_set_pos_layer(struct scene_layer *l, int x, int y)
 {
 	node_set_pos(&l->base, x, y);
 }
+
+void
+scene_set_scale_view(struct scene_view *v, float scale)
+{
+	node_set_scale(&v->base, scale);
+}
+
+void
+scene_set_scale_layer(struct scene_layer *l, float scale)
+{
+	node_set_scale(&l->base, scale);
+}
+
+void
+scene_set_rotation_view(struct scene_view *v, float rotation)
+{
+	node_set_rotation(&v->base, rotation);
+}
+
+void
+scene_set_rotation_layer(struct scene_layer *l, float rotation)
+{
+	node_set_rotation(&l->base, rotation);
+}
+
+void
+scene_set_opacity_view(struct scene_view *v, float opacity)
+{
+	node_set_opacity(&v->base, opacity);
+}
+
+void
+scene_set_opacity_layer(struct scene_layer *l, float opacity)
+{
+	node_set_opacity(&l->base, opacity);
+}
+
+void
+scene_view_set_texture(struct scene_view *v, struct vulkan_texture *texture)
+{
+	struct scene *s = v->base.scene;
+
+	if (s->nodes.texture[v->base.id] == texture)
+		return;
+
+	s->nodes.texture[v->base.id] = texture;
+	node_damage(s, v->base.id);
+}
+
+void
+scene_view_set_opaque(struct scene_view *v, bool opaque)
+{
+	struct scene *s = v->base.scene;
+	uint16_t *flags = &s->nodes.flags[v->base.id];
+
+	if (!!(*flags & SCENE_NODE_OPAQUE) == opaque)
+		return;
+
+	if (opaque)
+		*flags |= SCENE_NODE_OPAQUE;
+	else
+		*flags &= ~SCENE_NODE_OPAQUE;
+	node_damage(s, v->base.id);
+}
+
+void
+scene_layer_set_cached(struct scene_layer *l, bool cached)
+{
+	struct scene *s = l->base.scene;
+	struct scene_nodes *n = &s->nodes;
+	uint32_t id = l->base.id;
+
+	if (!!(n->flags[id] & SCENE_NODE_CACHED) == cached)
+		return;
+
+	if (cached) {
+		n->flags[id] |= SCENE_NODE_CACHED;
+		/* Transactions hand out slots at the commit */
+		if (s->transaction == 0 && node_is_attached(s, id) &&
+		    n->slot[id] < 0)
+			n->slot[id] = scene_alloc_slot(s);
+	} else {
+		scene_layer_drop_cache(s, id);
+		if (n->slot[id] >= 0)
+			scene_free_slot(s, n->slot[id]);
+		n->slot[id] = -1;
+	}
+
+	/* Nothing looks different, but it gets drawn differently */
+	node_damage(s, id);
+}
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "scene-queue.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int
+scene_queue_init(struct scene_queue *q, size_t size)
+{
+	size_t cap = 1;
+
+	while (cap < size)
+		cap *= 2;
+
+	q->cells = calloc(cap, sizeof *q->cells);
+	if (!q->cells) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (size_t i = 0; i < cap; ++i)
+		atomic_init(&q->cells[i].sequence, i);
+
+	q->mask = cap - 1;
+	atomic_init(&q->head, 0);
+	q->tail = 0;
+
+	return 0;
+}
+
+void
+scene_queue_finish(struct scene_queue *q)
+{
+	free(q->cells);
+}
+
+/*
+ * A cell whose sequence matches the position is free to claim, which is
+ * done by moving head past it. If it's behind, the consumer hasn't got to
+ * it since we went around the ring last, so we're full.
+ */
+bool
+scene_queue_push(struct scene_queue *q, const struct scene_op *op)
+{
+	struct scene_queue_cell *cell;
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+
+		size_t seq = atomic_load_explicit(&cell->sequence,
+						  memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			/* Updates pos if someone else got there first */
+			if (atomic_compare_exchange_weak_explicit(&q->head,
+					&pos, pos + 1,
+					memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->head,
+						   memory_order_relaxed);
+		}
+	}
+
+	cell->op = *op;
+	atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+	return true;
+}
+
+/*
+ * Stops after one lap of the ring, so producers that keep on going can't
+ * keep us here forever.
+ */
+size_t
+scene_queue_apply(struct scene_queue *q, struct scene *s)
+{
+	size_t count = 0;
+
+	scene_transaction_begin(s);
+
+	while (count <= q->mask) {
+		struct scene_queue_cell *cell = &q->cells[q->tail & q->mask];
+		size_t seq = atomic_load_explicit(&cell->sequence,
+						  memory_order_acquire);
+
+		/* Not written yet */
+		if (seq != q->tail + 1)
+			break;
+
+		scene_apply_op(s, &cell->op);
+
+		/* Hand it back to the producers for the next lap */
+		atomic_store_explicit(&cell->sequence, q->tail + q->mask + 1,
+				      memory_order_release);
+		++q->tail;
+		++count;
+	}
+
+	scene_transaction_commit(s);
+
+	return count;
+}
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef NORI_SCENE_QUEUE_H
+#define NORI_SCENE_QUEUE_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "scene.h"
+
+/* Keeps the producers' and consumer's ends on different cache lines */
+#define SCENE_QUEUE_ALIGN 64
+
+struct scene_queue_cell {
+	/*
+	 * Says whose turn it is: the cell's position for producers, one more
+	 * than that once the op is written and it's the consumer's.
+	 */
+	atomic_size_t sequence;
+	struct scene_op op;
+};
+
+/*
+ * Fixed-size ring of scene operations. Any number of threads can queue
+ * operations without taking a lock, and the thread owning the scene applies
+ * them all at once. Operations from one thread are applied in the order they
+ * were queued.
+ */
+struct scene_queue {
+	struct scene_queue_cell *cells;
+	size_t mask;
+
+	/* Next position to hand to a producer */
+	alignas(SCENE_QUEUE_ALIGN) atomic_size_t head;
+	/* Next position to apply; only touched by the owning thread */
+	alignas(SCENE_QUEUE_ALIGN) size_t tail;
+};
+
+/* Size is rounded up to a power of two */
+int
+scene_queue_init(struct scene_queue *q, size_t size);
+void
+scene_queue_finish(struct scene_queue *q);
+
+/*
+ * Can be called from any thread. Returns false if the queue is full, in
+ * which case it's up to the caller to try again later. The nodes must stay
+ * around until the operation is applied.
+ */
+bool
+scene_queue_push(struct scene_queue *q, const struct scene_op *op);
+
+/*
+ * Applies everything queued so far to the scene in one transaction. Only
+ * for the thread owning the scene. Returns how many operations there were.
+ */
+size_t
+scene_queue_apply(struct scene_queue *q, struct scene *s);
+
+#endif
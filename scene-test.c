@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Checks the scene tells the renderer about everything it has to redraw.
+ * Exits non-zero on the first thing it gets wrong.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scene.h"
+
+/* Never dereferenced by the scene */
+static struct vulkan_texture *texture = (struct vulkan_texture *)0x1000;
+
+static bool
+redraws(struct scene *s, struct scene_layer *l, struct rect *bounds)
+{
+	const struct scene_snapshot *snap = scene_acquire_snapshot(s);
+	bool found = false;
+
+	for (uint32_t i = 0; snap && i < snap->num_redraw; ++i) {
+		if (snap->redraw[i].id != l->base.id)
+			continue;
+
+		*bounds = snap->redraw[i].bounds;
+		found = true;
+	}
+
+	scene_release_snapshot(s);
+	return found;
+}
+
+/*
+ * Moving a view out of a cached layer in a transaction has to invalidate
+ * the cache it left, which the commit never sees as the view's ancestor.
+ */
+static int
+test_reparent_out_of_cache(void)
+{
+	struct scene *s = scene_create();
+	struct rect viewport = { 0, 0, 100, 100 }, bounds;
+	struct scene_layer *root, *cached, *other;
+	struct scene_view *stays, *leaves;
+	int ret = -1;
+
+	if (!s)
+		return -1;
+
+	root = scene_layer_create(s);
+	cached = scene_layer_create(s);
+	other = scene_layer_create(s);
+	stays = scene_view_create(s, 10, 10);
+	leaves = scene_view_create(s, 10, 10);
+	if (!root || !cached || !other || !stays || !leaves)
+		goto out;
+
+	scene_set_viewport(s, &viewport);
+	scene_view_set_texture(stays, texture);
+	scene_view_set_texture(leaves, texture);
+
+	scene_set_root_layer(s, root);
+	scene_push_layer(root, cached);
+	scene_push_layer(root, other);
+	scene_layer_set_cached(cached, true);
+	scene_push_view(cached, stays);
+	scene_push_view(cached, leaves);
+	scene_set_pos_view(leaves, 50, 50);
+	scene_update(s);
+	scene_publish(s);
+
+	if (!redraws(s, cached, &bounds)) {
+		fprintf(stderr, "New cache wasn't drawn\n");
+		goto out;
+	}
+
+	scene_transaction_begin(s);
+	scene_push_view(other, leaves);
+	scene_transaction_commit(s);
+
+	if (!redraws(s, cached, &bounds)) {
+		fprintf(stderr, "Cache wasn't redrawn after losing a view\n");
+		goto out;
+	}
+
+	if (bounds.width != 10 || bounds.height != 10) {
+		fprintf(stderr, "Cache still covers %dx%d\n",
+			bounds.width, bounds.height);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	scene_destroy(s);
+	return ret;
+}
+
+/*
+ * A snapshot the renderer couldn't draw, after a newer one was published
+ * without its redraws, has to have them carried into the one after.
+ */
+static int
+test_return_superseded(void)
+{
+	struct scene *s = scene_create();
+	struct rect viewport = { 0, 0, 100, 100 }, bounds;
+	struct scene_layer *root, *cached;
+	struct scene_view *inside, *outside;
+	int ret = -1;
+
+	if (!s)
+		return -1;
+
+	root = scene_layer_create(s);
+	cached = scene_layer_create(s);
+	inside = scene_view_create(s, 10, 10);
+	outside = scene_view_create(s, 10, 10);
+	if (!root || !cached || !inside || !outside)
+		goto out;
+
+	scene_set_viewport(s, &viewport);
+	scene_view_set_texture(inside, texture);
+	scene_view_set_texture(outside, texture);
+
+	scene_set_root_layer(s, root);
+	scene_push_layer(root, cached);
+	scene_push_view(root, outside);
+	scene_layer_set_cached(cached, true);
+	scene_push_view(cached, inside);
+	scene_update(s);
+	scene_publish(s);
+
+	/* Held by the renderer while the next one goes out */
+	scene_acquire_snapshot(s);
+	scene_set_pos_view(outside, 20, 20);
+	scene_update(s);
+	scene_publish(s);
+	scene_return_snapshot(s);
+
+	scene_set_pos_view(outside, 30, 30);
+	scene_update(s);
+	scene_publish(s);
+
+	if (!redraws(s, cached, &bounds)) {
+		fprintf(stderr, "Returned snapshot's redraw was lost\n");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	scene_destroy(s);
+	return ret;
+}
+
+/*
+ * Destroying a layer leaves its views' slots and grid entries behind until
+ * the next update, which has to get rid of them even if the layer's id was
+ * handed out again in the meantime.
+ */
+static int
+test_destroy_subtree(void)
+{
+	struct scene *s = scene_create();
+	struct scene_layer *root, *doomed;
+	struct scene_view *a, *b, *reused;
+	int num_slots, ret = -1;
+
+	if (!s)
+		return -1;
+
+	root = scene_layer_create(s);
+	doomed = scene_layer_create(s);
+	a = scene_view_create(s, 10, 10);
+	b = scene_view_create(s, 10, 10);
+	if (!root || !doomed || !a || !b)
+		goto out;
+
+	scene_set_root_layer(s, root);
+	scene_push_layer(root, doomed);
+	scene_push_view(doomed, a);
+	scene_push_view(doomed, b);
+	scene_update(s);
+	num_slots = s->num_slots;
+
+	scene_layer_destroy(doomed);
+	reused = scene_view_create(s, 10, 10);
+	if (!reused)
+		goto out;
+	scene_push_view(root, reused);
+	scene_set_pos_view(reused, 50, 50);
+
+	if (scene_pick(s, 5, 5)) {
+		fprintf(stderr, "Destroyed view can still be picked\n");
+		goto out;
+	}
+
+	if (scene_pick(s, 55, 55) != reused) {
+		fprintf(stderr, "New view can't be picked\n");
+		goto out;
+	}
+
+	if (s->num_slots != num_slots) {
+		fprintf(stderr, "Destroyed views' slots weren't reused\n");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	scene_destroy(s);
+	return ret;
+}
+
+int
+main(void)
+{
+	if (test_reparent_out_of_cache() < 0)
+		return EXIT_FAILURE;
+	if (test_return_superseded() < 0)
+		return EXIT_FAILURE;
+	if (test_destroy_subtree() < 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
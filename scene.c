@@ -2,10 +2,11 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <wayland-util.h>
 
 struct scene *
 scene_create(void)
@@ -16,216 +17,1238 @@ scene_create(void)
 		return NULL;
 	}
 
+	s->root = SCENE_NONE;
+	s->nodes.free = SCENE_NONE;
+	grid_init(&s->grid);
+	region_init(&s->damage);
+
+	s->write_quads = quad_get_writer();
+
+	s->latest = -1;
+	s->in_use = -1;
+	s->returned = -1;
+	pthread_mutex_init(&s->snapshot_lock, NULL);
+
 	return s;
 }
 
+static void
+nodes_finish(struct scene_nodes *n)
+{
+	for (uint32_t i = 0; i < n->num_slabs; ++i)
+		free(n->slabs[i]);
+	free(n->slabs);
+
+	free(n->type);
+	free(n->flags);
+	free(n->parent);
+	free(n->first_child);
+	free(n->last_child);
+	free(n->prev);
+	free(n->next);
+	free(n->decendent_views);
+	free(n->views_delta);
+	free(n->x);
+	free(n->y);
+	free(n->scale);
+	free(n->rotation);
+	free(n->opacity);
+	free(n->world);
+	free(n->world_opacity);
+	free(n->bounds);
+	free(n->width);
+	free(n->height);
+	free(n->texture);
+	free(n->slot);
+}
+
+static void
+snapshot_finish(struct scene_snapshot *snap)
+{
+	free(snap->quads);
+	free(snap->transforms);
+	free(snap->items);
+	free(snap->redraw);
+	free(snap->dropped);
+}
+
 void
 scene_destroy(struct scene *s)
 {
+	snapshot_finish(&s->snapshots[0]);
+	snapshot_finish(&s->snapshots[1]);
+	pthread_mutex_destroy(&s->snapshot_lock);
+
+	nodes_finish(&s->nodes);
+	grid_finish(&s->grid);
+	free(s->order);
+	free(s->order_end);
+	free(s->order_index);
+	free(s->touched);
+	free(s->visible);
+	free(s->dropped_caches);
+	free(s->pending);
+	free(s->pending_counts);
+	free(s->quads);
+	free(s->free_slots);
+	free(s->orphans);
+	if (s->pool)
+		pool_destroy(s->pool);
 	free(s);
 }
 
-size_t
-scene_get_num_nodes(struct scene *s)
+#define GROW(array, cap) do { \
+	void *tmp = realloc((array), (size_t)(cap) * sizeof *(array)); \
+	if (!tmp) \
+		goto err; \
+	(array) = tmp; \
+} while (0)
+
+static int
+nodes_grow(struct scene_nodes *n)
 {
-	if (!s->root)
-		return 0;
+	uint32_t cap = n->cap ? n->cap * 2 : 64;
+
+	/*
+	 * If any of these fail, the arrays that did grow are still valid,
+	 * just bigger than they need to be.
+	 */
+	GROW(n->type, cap);
+	GROW(n->flags, cap);
+	GROW(n->parent, cap);
+	GROW(n->first_child, cap);
+	GROW(n->last_child, cap);
+	GROW(n->prev, cap);
+	GROW(n->next, cap);
+	GROW(n->decendent_views, cap);
+	GROW(n->views_delta, cap);
+	GROW(n->x, cap);
+	GROW(n->y, cap);
+	GROW(n->scale, cap);
+	GROW(n->rotation, cap);
+	GROW(n->opacity, cap);
+	GROW(n->world, cap);
+	GROW(n->world_opacity, cap);
+	GROW(n->bounds, cap);
+	GROW(n->width, cap);
+	GROW(n->height, cap);
+	GROW(n->texture, cap);
+	GROW(n->slot, cap);
+
+	n->cap = cap;
+	return 0;
+
+err:
+	fprintf(stderr, "realloc: %s\n", strerror(errno));
+	return -1;
+}
+
+static struct scene_node *
+node_handle(struct scene_nodes *n, uint32_t id)
+{
+	return &n->slabs[id / SCENE_SLAB_SIZE][id % SCENE_SLAB_SIZE];
+}
+
+static int
+nodes_add_slab(struct scene_nodes *n)
+{
+	struct scene_node **slabs;
+	struct scene_node *slab;
+
+	slabs = realloc(n->slabs, (n->num_slabs + 1) * sizeof *slabs);
+	if (!slabs) {
+		fprintf(stderr, "realloc: %s\n", strerror(errno));
+		return -1;
+	}
+	n->slabs = slabs;
+
+	slab = calloc(SCENE_SLAB_SIZE, sizeof *slab);
+	if (!slab) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return -1;
+	}
+	n->slabs[n->num_slabs++] = slab;
+
+	return 0;
+}
+
+/*
+ * Takes a node off the free list. If it was a layer, whatever was still
+ * inside it goes on the free list in its place.
+ */
+static uint32_t
+nodes_reuse(struct scene *s)
+{
+	struct scene_nodes *n = &s->nodes;
+	uint32_t id = n->free;
+
+	/* Layers destroyed along with their parent still have their cache */
+	scene_layer_drop_cache(s, id);
+
+	/* Its subtree is about to be taken apart */
+	if (n->flags[id] & SCENE_NODE_ORPHAN)
+		scene_free_orphans(s);
+
+	n->free = n->next[id];
+
+	if (n->type[id] == SCENE_NODE_LAYER &&
+	    n->first_child[id] != SCENE_NONE) {
+		/*
+		 * Nothing should find its way up to whatever this id becomes,
+		 * e.g. when passing on view counts at a transaction commit.
+		 */
+		for (uint32_t c = n->first_child[id]; c != SCENE_NONE;
+		     c = n->next[c])
+			n->parent[c] = SCENE_NONE;
+
+		n->next[n->last_child[id]] = n->free;
+		n->free = n->first_child[id];
+	}
 
-	return s->root->decendent_views;
+	return id;
+}
+
+static struct scene_node *
+node_create(struct scene *s, enum scene_node_type type)
+{
+	struct scene_nodes *n = &s->nodes;
+	struct scene_node *handle;
+	uint32_t id;
+
+	/* Same size for every type of node */
+	static_assert(sizeof(struct scene_layer) == sizeof(struct scene_node),
+		      "Layer handle has extra fields");
+	static_assert(sizeof(struct scene_view) == sizeof(struct scene_node),
+		      "View handle has extra fields");
+
+	if (n->free != SCENE_NONE) {
+		id = nodes_reuse(s);
+	} else {
+		if (n->len == n->cap && nodes_grow(n) < 0)
+			return NULL;
+		if (n->len == n->num_slabs * SCENE_SLAB_SIZE &&
+		    nodes_add_slab(n) < 0)
+			return NULL;
+
+		id = n->len++;
+	}
+
+	handle = node_handle(n, id);
+	handle->scene = s;
+	handle->id = id;
+
+	n->type[id] = type;
+	n->flags[id] = 0;
+	n->parent[id] = SCENE_NONE;
+	n->first_child[id] = SCENE_NONE;
+	n->last_child[id] = SCENE_NONE;
+	n->prev[id] = SCENE_NONE;
+	n->next[id] = SCENE_NONE;
+	n->decendent_views[id] = type == SCENE_NODE_VIEW ? 1 : 0;
+	n->views_delta[id] = 0;
+	n->x[id] = 0;
+	n->y[id] = 0;
+	n->scale[id] = 1.0f;
+	n->rotation[id] = 0.0f;
+	n->opacity[id] = 1.0f;
+	transform_identity(&n->world[id]);
+	n->world_opacity[id] = 1.0f;
+	n->bounds[id] = (struct rect) { 0 };
+	n->width[id] = 0;
+	n->height[id] = 0;
+	n->texture[id] = NULL;
+	n->slot[id] = -1;
+
+	return handle;
+}
+
+struct scene_layer *
+scene_layer_create(struct scene *s)
+{
+	return (struct scene_layer *)node_create(s, SCENE_NODE_LAYER);
+}
+
+struct scene_view *
+scene_view_create(struct scene *s, int width, int height)
+{
+	struct scene_node *v = node_create(s, SCENE_NODE_VIEW);
+	if (!v)
+		return NULL;
+
+	s->nodes.width[v->id] = width;
+	s->nodes.height[v->id] = height;
+
+	return (struct scene_view *)v;
+}
+
+void
+scene_get_pos_view(struct scene_view *v, int *x, int *y)
+{
+	struct scene_nodes *n = &v->base.scene->nodes;
+
+	*x = n->x[v->base.id];
+	*y = n->y[v->base.id];
+}
+
+void
+scene_get_pos_layer(struct scene_layer *l, int *x, int *y)
+{
+	struct scene_nodes *n = &l->base.scene->nodes;
+
+	*x = n->x[l->base.id];
+	*y = n->y[l->base.id];
+}
+
+uint64_t
+scene_get_generation(struct scene *s)
+{
+	return s->generation;
+}
+
+const struct region *
+scene_get_damage(struct scene *s)
+{
+	return &s->damage;
 }
 
 size_t
-scene_get_vertex_size(struct scene *s)
+scene_get_num_nodes(struct scene *s)
 {
-	return scene_get_num_nodes(s) * 6 * 4;
+	if (s->root == SCENE_NONE)
+		return 0;
+
+	return s->nodes.decendent_views[s->root];
 }
 
+/*
+ * Walks the tree links, which is the only time we go chasing them;
+ * everything else just streams through the resulting arrays.
+ */
 static void
-write_node(struct scene_node *n, float *vert, size_t *i, float x, float y);
+rebuild_order(struct scene *s)
+{
+	struct scene_nodes *n = &s->nodes;
+	uint32_t len = 0;
+	uint32_t id = s->root;
+
+	if (s->order_cap < n->cap) {
+		uint32_t cap = n->cap;
+
+		GROW(s->order, cap);
+		GROW(s->order_end, cap);
+		GROW(s->order_index, cap);
+		GROW(s->touched, cap);
+		GROW(s->visible, cap);
+
+		for (uint32_t i = s->order_cap; i < cap; ++i)
+			s->order_index[i] = SCENE_NONE;
+		s->order_cap = cap;
+	}
+
+	while (id != SCENE_NONE) {
+		s->order_index[id] = len;
+		s->order[len++] = id;
+
+		if (n->first_child[id] != SCENE_NONE) {
+			id = n->first_child[id];
+			continue;
+		}
+
+		/* Finished a subtree; go back up until there's a sibling */
+		for (;;) {
+			s->order_end[s->order_index[id]] = len;
+
+			if (id == s->root) {
+				id = SCENE_NONE;
+				break;
+			}
+			if (n->next[id] != SCENE_NONE) {
+				id = n->next[id];
+				break;
+			}
+			id = n->parent[id];
+		}
+	}
 
+	s->order_len = len;
+	s->order_dirty = false;
+	return;
+
+err:
+	fprintf(stderr, "realloc: %s\n", strerror(errno));
+}
+
+/*
+ * Views are written relative to their parent, whose world transform gets
+ * applied when drawing. Cached layers are drawn over their bounds, since
+ * that's what their texture covers.
+ */
 static void
-write_layer(struct scene_layer *l, float *vert, size_t *i, float x, float y)
+batch_add(struct scene *s, struct quad_batch *b, uint32_t id)
 {
-	struct scene_node *n;
-	wl_list_for_each(n, &l->children, link) {
-		write_node(n, vert, i, x, y);
+	struct scene_nodes *n = &s->nodes;
+	struct transform t;
+	size_t i = b->len++;
+
+	if (n->type[id] == SCENE_NODE_VIEW) {
+		transform_init(&t, n->x[id], n->y[id],
+			       n->scale[id], n->rotation[id]);
+		b->width[i] = n->width[id];
+		b->height[i] = n->height[id];
+	} else {
+		transform_init(&t, n->bounds[id].x, n->bounds[id].y,
+			       1.0f, 0.0f);
+		b->width[i] = n->bounds[id].width;
+		b->height[i] = n->bounds[id].height;
 	}
+
+	b->x[i] = t.x0;
+	b->y[i] = t.y0;
+	b->xx[i] = t.xx;
+	b->xy[i] = t.xy;
+	b->yx[i] = t.yx;
+	b->yy[i] = t.yy;
+	b->slots[i] = n->slot[id];
 }
 
+/*
+ * A layer's cache holds its contents as they appear in the scene, lined up
+ * with whole pixels. Moving the layer by whole pixels or fading it doesn't
+ * change what's in there, but anything else does.
+ */
+static bool
+cache_survives(const struct transform *old, const struct transform *new)
+{
+	return old->xx == new->xx && old->xy == new->xy &&
+		old->yx == new->yx && old->yy == new->yy &&
+		old->x0 - floorf(old->x0) == new->x0 - floorf(new->x0) &&
+		old->y0 - floorf(old->y0) == new->y0 - floorf(new->y0);
+}
+
+/*
+ * Everything in [start, end) of the order moved, so recompute world
+ * transforms. Parents always come before their children, so theirs are
+ * already up to date by the time we get to the children.
+ */
 static void
-emit_vertex(float *vert, size_t *i,
-	    float x, float y, float tex_x, float tex_y)
+update_range(struct scene *s, uint32_t start, uint32_t end, uint32_t *touched)
 {
-	vert[*i + 0] = x;
-	vert[*i + 1] = y;
-	vert[*i + 2] = tex_x;
-	vert[*i + 3] = tex_y;
+	struct scene_nodes *n = &s->nodes;
+
+	for (uint32_t i = start; i < end; ++i) {
+		uint32_t id = s->order[i];
+		uint32_t parent = n->parent[id];
+		struct transform world;
+		float opacity = n->opacity[id];
+
+		transform_init(&world, n->x[id], n->y[id],
+			       n->scale[id], n->rotation[id]);
+		if (parent != SCENE_NONE) {
+			transform_multiply(&world, &n->world[parent], &world);
+			opacity *= n->world_opacity[parent];
+		}
 
-	*i += 4;
+		if ((n->flags[id] & SCENE_NODE_CACHED) &&
+		    !cache_survives(&n->world[id], &world))
+			n->flags[id] &= ~SCENE_NODE_CACHE_VALID;
+
+		n->world[id] = world;
+		n->world_opacity[id] = opacity;
+
+		if (n->type[id] == SCENE_NODE_VIEW) {
+			struct rect box;
+
+			transform_box(&world, n->width[id], n->height[id], &box);
+			grid_insert(&s->grid, id, &box);
+
+			/* node_damage left where it ends up to us */
+			region_add_rect(&s->damage, box.x, box.y,
+					box.width, box.height);
+
+			/*
+			 * Vertices only depend on the view itself, so moving
+			 * its parents leaves them alone. They're written once
+			 * we know it's visible.
+			 */
+			if (n->flags[id] & SCENE_NODE_DIRTY)
+				n->flags[id] |= SCENE_NODE_STALE;
+		}
+
+		n->flags[id] &= ~(SCENE_NODE_DIRTY | SCENE_NODE_CHILD_DIRTY);
+
+		s->touched[(*touched)++] = i;
+	}
 }
 
 static void
-write_view(struct scene_view *v, float *vert, size_t *i, float x, float y)
+rect_union(struct rect *out, const struct rect *a, const struct rect *b)
 {
-	/* Top left */
-	emit_vertex(vert, i, x, y, 0.0f, 0.0f);
-	/* Top right */
-	emit_vertex(vert, i, x + v->width, y, 1.0f, 0.0f);
-	/* Bottom right */
-	emit_vertex(vert, i, x + v->width, y + v->height, 1.0f, 1.0f);
+	int32_t x1, y1, x2, y2;
+
+	if (a->width <= 0 || a->height <= 0) {
+		*out = *b;
+		return;
+	}
+	if (b->width <= 0 || b->height <= 0) {
+		*out = *a;
+		return;
+	}
 
-	/* Bottom right */
-	emit_vertex(vert, i, x + v->width, y + v->height, 1.0f, 1.0f);
-	/* Bottom left */
-	emit_vertex(vert, i, x, y + v->height, 0.0f, 1.0f);
-	/* Top left */
-	emit_vertex(vert, i, x, y, 0.0f, 0.0f);
+	x1 = a->x < b->x ? a->x : b->x;
+	y1 = a->y < b->y ? a->y : b->y;
+	x2 = a->x + a->width > b->x + b->width ?
+		a->x + a->width : b->x + b->width;
+	y2 = a->y + a->height > b->y + b->height ?
+		a->y + a->height : b->y + b->height;
+
+	*out = (struct rect) {
+		.x = x1,
+		.y = y1,
+		.width = x2 - x1,
+		.height = y2 - y1,
+	};
 }
 
 static void
-write_node(struct scene_node *n, float *vert, size_t *i, float x, float y)
+update_bounds(struct scene *s, uint32_t id)
 {
-	x += n->x;
-	y += n->y;
+	struct scene_nodes *n = &s->nodes;
+	struct rect box = { 0 };
 
-	switch (n->type) {
+	switch (n->type[id]) {
 	case SCENE_NODE_LAYER:
-		write_layer((struct scene_layer *)n, vert, i, x, y);
+		for (uint32_t c = n->first_child[id]; c != SCENE_NONE;
+		     c = n->next[c])
+			rect_union(&box, &box, &n->bounds[c]);
+
+		if (n->flags[id] & SCENE_NODE_CACHED)
+			n->flags[id] |= SCENE_NODE_STALE;
 		break;
 	case SCENE_NODE_VIEW:
-		write_view((struct scene_view *)n, vert, i, x, y);
+		transform_box(&n->world[id], n->width[id], n->height[id], &box);
 		break;
 	}
+
+	n->bounds[id] = box;
 }
 
+/*
+ * Recomputes the positions of dirty nodes, and everything below them, since
+ * their positions depend on their parents. Subtrees with nothing dirty in
+ * them are skipped entirely.
+ *
+ * Bounds then have to be fixed up for everything we looked at, which is the
+ * moved nodes and their ancestors. Going through those backwards gets to
+ * children before their parents.
+ */
 void
-scene_get_vertex_data(struct scene *s, float *vert)
+scene_update(struct scene *s)
+{
+	struct scene_nodes *n = &s->nodes;
+	uint32_t touched = 0;
+	uint32_t i = 0;
+
+	scene_free_orphans(s);
+
+	if (s->order_dirty)
+		rebuild_order(s);
+
+	while (i < s->order_len) {
+		uint32_t id = s->order[i];
+
+		if (n->flags[id] & SCENE_NODE_DIRTY) {
+			update_range(s, i, s->order_end[i], &touched);
+			i = s->order_end[i];
+		} else if (n->flags[id] & SCENE_NODE_CHILD_DIRTY) {
+			n->flags[id] &= ~SCENE_NODE_CHILD_DIRTY;
+			s->touched[touched++] = i;
+			++i;
+		} else {
+			i = s->order_end[i];
+		}
+	}
+
+	while (touched-- > 0)
+		update_bounds(s, s->order[s->touched[touched]]);
+}
+
+static bool
+rects_overlap(const struct rect *a, const struct rect *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+		a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+static bool
+rect_contains(const struct rect *a, const struct rect *b)
+{
+	return b->x >= a->x && b->y >= a->y &&
+		b->x + b->width <= a->x + a->width &&
+		b->y + b->height <= a->y + a->height;
+}
+
+/*
+ * Remembers an opaque rectangle. Once we run out of space, the smallest
+ * ones are forgotten, which can only make us draw more than we need to.
+ */
+static void
+add_occluder(struct rect *occluders, int *num, const struct rect *r)
 {
-	size_t i = 0;
-	size_t len = scene_get_vertex_size(s);
+	int smallest = 0;
 
-	if (!s->root)
+	if (*num < SCENE_MAX_OCCLUDERS) {
+		occluders[(*num)++] = *r;
 		return;
+	}
+
+	for (int i = 1; i < *num; ++i) {
+		if ((int64_t)occluders[i].width * occluders[i].height <
+		    (int64_t)occluders[smallest].width *
+		    occluders[smallest].height)
+			smallest = i;
+	}
+
+	if ((int64_t)r->width * r->height >
+	    (int64_t)occluders[smallest].width * occluders[smallest].height)
+		occluders[smallest] = *r;
+}
+
+/*
+ * The area an opaque view is sure to cover, on whole pixels. Views which
+ * are rotated or faded don't cover anything for sure.
+ */
+static bool
+get_opaque_box(struct scene *s, uint32_t id, struct rect *box)
+{
+	struct scene_nodes *n = &s->nodes;
+	const struct transform *t = &n->world[id];
+	float x1, y1, x2, y2;
+
+	if (!(n->flags[id] & SCENE_NODE_OPAQUE) ||
+	    n->world_opacity[id] < 1.0f || !transform_is_axis_aligned(t))
+		return false;
 
-	write_node(s->root, vert, &i, 0.0f, 0.0f);
+	transform_point(t, 0.0f, 0.0f, &x1, &y1);
+	transform_point(t, n->width[id], n->height[id], &x2, &y2);
 
-	assert(i == len);
+	*box = (struct rect) {
+		.x = (int32_t)ceilf(fminf(x1, x2)),
+		.y = (int32_t)ceilf(fminf(y1, y2)),
+	};
+	box->width = (int32_t)floorf(fmaxf(x1, x2)) - box->x;
+	box->height = (int32_t)floorf(fmaxf(y1, y2)) - box->y;
 
-	printf("===\n");
+	return box->width > 0 && box->height > 0;
+}
+
+/* Queues up the view's quad to be written if it changed */
+static void
+add_stale(struct scene *s, uint32_t id, uint32_t *num_stale)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	if (n->flags[id] & SCENE_NODE_STALE) {
+		s->touched[(*num_stale)++] = id;
+		n->flags[id] &= ~SCENE_NODE_STALE;
+	}
+}
+
+/* Gathers the quads in batches for the writer, which has its own loop */
+static void
+write_stale_range(void *data, size_t start, size_t end)
+{
+	struct scene *s = data;
+	struct quad_batch batch;
 
-	float (*vert_data)[8] = (void *)vert;
-	for (size_t i = 0; i < len / 8; ++i) {
-		for (int j = 0; j < 4; ++j)
-			printf("(%.1f, %.1f), ", vert_data[i][j * 2],
-			       vert_data[i][j * 2 + 1]);
-		printf("\n");
+	batch.len = 0;
+	for (size_t i = start; i < end; ++i) {
+		uint32_t id = s->touched[i];
+
+		if (s->nodes.slot[id] < 0)
+			continue;
+
+		batch_add(s, &batch, id);
+		if (batch.len == QUAD_BATCH) {
+			s->write_quads(s->quads, &batch);
+			batch.len = 0;
+		}
 	}
 
-	printf("===\n");
+	if (batch.len > 0)
+		s->write_quads(s->quads, &batch);
 }
 
+/* Only reads the nodes, and every quad has its own slot */
 static void
-for_each_node(struct scene_node *n, scene_iter_fn fn, void *data)
+write_stale(struct scene *s, uint32_t num_stale)
 {
-	struct scene_layer *l;
-	struct scene_node *iter;
-	
-	switch (n->type) {
-	case SCENE_NODE_LAYER:
-		l = (struct scene_layer *)n;
-		wl_list_for_each(iter, &l->children, link)
-			for_each_node(iter, fn, data);
-		break;
-	case SCENE_NODE_VIEW:
-		fn((struct scene_view *)n, data);
-		break;
+	struct scene_nodes *n = &s->nodes;
+	uint32_t start = UINT32_MAX, end = 0;
+
+	for (uint32_t i = 0; i < num_stale; ++i) {
+		int32_t slot = n->slot[s->touched[i]];
+
+		if (slot < 0)
+			continue;
+		if ((uint32_t)slot < start)
+			start = slot;
+		if ((uint32_t)slot >= end)
+			end = slot + 1;
+	}
+
+	/* scene_publish only copies these into the snapshots */
+	for (int i = 0; start < end && i < 2; ++i) {
+		if (s->quads_start[i] == s->quads_end[i] ||
+		    start < s->quads_start[i])
+			s->quads_start[i] = start;
+		if (end > s->quads_end[i])
+			s->quads_end[i] = end;
 	}
+
+	if (num_stale >= SCENE_PARALLEL_MIN && !s->pool_tried) {
+		s->pool = pool_create(0);
+		s->pool_tried = true;
+	}
+
+	if (num_stale >= SCENE_PARALLEL_MIN && s->pool)
+		pool_run(s->pool, write_stale_range, s, num_stale,
+			 SCENE_PARALLEL_CHUNK);
+	else
+		write_stale_range(s, 0, num_stale);
+}
+
+/*
+ * First collects the views in the viewport, skipping over whole subtrees
+ * whose bounds are outside of it. Then walks those front to back, dropping
+ * any that are completely inside a single opaque view above them.
+ *
+ * Cached layers are treated like a view. If they need to be redrawn, the
+ * views inside them need their quads too.
+ */
+static void
+rebuild_visible(struct scene *s)
+{
+	struct scene_nodes *n = &s->nodes;
+	struct rect occluders[SCENE_MAX_OCCLUDERS];
+	int num_occluders = 0;
+	uint32_t len = 0;
+	uint32_t num_stale = 0;
+	uint32_t first;
+	uint32_t i = 0;
+
+	while (i < s->order_len) {
+		uint32_t id = s->order[i];
+
+		if (n->bounds[id].width <= 0 || n->bounds[id].height <= 0 ||
+		    n->world_opacity[id] <= 0.0f ||
+		    (s->has_viewport &&
+		     !rects_overlap(&n->bounds[id], &s->viewport))) {
+			i = s->order_end[i];
+			continue;
+		}
+
+		if (n->flags[id] & SCENE_NODE_CACHED) {
+			s->visible[len++] = id;
+
+			if (!(n->flags[id] & SCENE_NODE_CACHE_VALID)) {
+				for (uint32_t j = i + 1; j < s->order_end[i]; ++j)
+					add_stale(s, s->order[j], &num_stale);
+			}
+
+			i = s->order_end[i];
+			continue;
+		}
+
+		if (n->type[id] == SCENE_NODE_VIEW)
+			s->visible[len++] = id;
+		++i;
+	}
+
+	/* Survivors get packed at the end, still in painter's order */
+	first = len;
+	for (uint32_t j = len; j-- > 0;) {
+		uint32_t id = s->visible[j];
+		const struct rect *box = &n->bounds[id];
+		struct rect opaque;
+		bool hidden = false;
+
+		for (int k = 0; k < num_occluders && !hidden; ++k)
+			hidden = rect_contains(&occluders[k], box);
+		if (hidden)
+			continue;
+
+		s->visible[--first] = id;
+
+		if (get_opaque_box(s, id, &opaque))
+			add_occluder(occluders, &num_occluders, &opaque);
+	}
+
+	s->visible_len = len - first;
+	memmove(s->visible, s->visible + first,
+		s->visible_len * sizeof *s->visible);
+
+	for (uint32_t j = 0; j < s->visible_len; ++j)
+		add_stale(s, s->visible[j], &num_stale);
+	write_stale(s, num_stale);
+
+	s->visible_generation = s->generation;
+	s->visible_valid = true;
+}
+
+/* Gets everything ready for drawing */
+static void
+scene_prepare(struct scene *s)
+{
+	scene_update(s);
+
+	if (!s->visible_valid || s->visible_generation != s->generation)
+		rebuild_visible(s);
+}
+
+uint32_t
+scene_get_transform_id(struct scene *s, uint32_t id)
+{
+	if (s->nodes.type[id] != SCENE_NODE_VIEW)
+		return SCENE_NONE;
+
+	return s->nodes.parent[id];
 }
 
 void
-scene_for_each(struct scene *s, scene_iter_fn fn, void *data)
+scene_set_viewport(struct scene *s, const struct rect *viewport)
 {
-	if (!s->root)
+	if (s->has_viewport && s->viewport.x == viewport->x &&
+	    s->viewport.y == viewport->y &&
+	    s->viewport.width == viewport->width &&
+	    s->viewport.height == viewport->height)
 		return;
 
-	for_each_node(s->root, fn, data);
+	s->viewport = *viewport;
+	s->has_viewport = true;
+	s->visible_valid = false;
+	/* Different things are visible now */
+	++s->generation;
 }
 
-struct scene_layer *
-scene_layer_create(void)
+void
+scene_for_each_visible(struct scene *s, scene_iter_fn fn, void *data)
 {
-	struct scene_layer *l = calloc(1, sizeof *l);
-	if (!l) {
-		fprintf(stderr, "calloc: %s\n", strerror(errno));
-		return NULL;
-	}
+	scene_prepare(s);
 
-	wl_list_init(&l->base.link);
-	l->base.type = SCENE_NODE_LAYER;
-	l->base.decendent_views = 0;
-	wl_list_init(&l->children);
+	for (uint32_t i = 0; i < s->visible_len; ++i)
+		fn(s, s->visible[i], data);
+}
 
-	return l;
+void
+scene_for_each(struct scene *s, scene_iter_fn fn, void *data)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	if (s->order_dirty)
+		rebuild_order(s);
+
+	for (uint32_t i = 0; i < s->order_len; ++i) {
+		uint32_t id = s->order[i];
+
+		if (n->type[id] == SCENE_NODE_VIEW)
+			fn(s, id, data);
+	}
 }
 
-struct scene_view *
-scene_view_create(int width, int height)
+void
+scene_layer_drop_cache(struct scene *s, uint32_t id)
 {
-	struct scene_view *v = calloc(1, sizeof *v);
-	if (!v) {
-		fprintf(stderr, "calloc: %s\n", strerror(errno));
-		return NULL;
+	struct scene_nodes *n = &s->nodes;
+
+	if (n->type[id] != SCENE_NODE_LAYER ||
+	    !(n->flags[id] & SCENE_NODE_CACHED))
+		return;
+
+	n->flags[id] &= ~(SCENE_NODE_CACHED | SCENE_NODE_CACHE_VALID);
+
+	if (s->num_dropped_caches == s->dropped_caches_cap) {
+		uint32_t cap = s->dropped_caches_cap ?
+			s->dropped_caches_cap * 2 : 16;
+		uint32_t *dropped = realloc(s->dropped_caches,
+			cap * sizeof *dropped);
+		if (!dropped) {
+			/* Just leak the texture */
+			fprintf(stderr, "realloc: %s\n", strerror(errno));
+			return;
+		}
+
+		s->dropped_caches = dropped;
+		s->dropped_caches_cap = cap;
 	}
 
-	wl_list_init(&v->base.link);
-	v->base.type = SCENE_NODE_VIEW;
-	v->base.decendent_views = 1;
-	v->width = width;
-	v->height = height;
+	s->dropped_caches[s->num_dropped_caches++] = id;
+	/* Gives the renderer a reason to look at the next snapshot */
+	++s->generation;
+}
+
+#define RESERVE(array, cap, len) do { \
+	if ((len) > (cap)) { \
+		GROW(array, len); \
+		(cap) = (len); \
+	} \
+} while (0)
 
-	return v;
+/* Makes room for everything up front, so filling it in can't fail */
+static int
+snapshot_reserve(struct scene *s, struct scene_snapshot *snap,
+		 uint32_t num_dropped)
+{
+	RESERVE(snap->quads, snap->quads_cap, (uint32_t)s->num_slots);
+	RESERVE(snap->transforms, snap->transforms_cap, s->nodes.len + 1);
+	/* Nodes are either visible or inside a cache being redrawn */
+	RESERVE(snap->items, snap->items_cap, s->nodes.len);
+	RESERVE(snap->redraw, snap->redraw_cap, s->visible_len);
+	RESERVE(snap->dropped, snap->dropped_cap, num_dropped);
+
+	return 0;
+
+err:
+	fprintf(stderr, "realloc: %s\n", strerror(errno));
+	return -1;
 }
 
 static void
-dump_node(struct scene_node *n, int depth);
+snapshot_add_item(struct scene *s, struct scene_snapshot *snap, uint32_t id)
+{
+	struct scene_nodes *n = &s->nodes;
+	bool layer = n->type[id] == SCENE_NODE_LAYER;
+	uint32_t transform = scene_get_transform_id(s, id);
+
+	/* Nothing to draw */
+	if (n->slot[id] < 0 || (!layer && !n->texture[id]))
+		return;
+
+	snap->items[snap->num_items++] = (struct scene_snapshot_item) {
+		.id = id,
+		.slot = n->slot[id],
+		/* Shifted by one for the identity at the start */
+		.transform = transform == SCENE_NONE ? 0 : transform + 1,
+		.opacity = n->world_opacity[id],
+		.texture = layer ? NULL : n->texture[id],
+	};
+}
 
 static void
-dump_layer(struct scene_layer *l, int depth)
+snapshot_add_redraw(struct scene *s, struct scene_snapshot *snap,
+		    uint32_t id)
 {
-	for (int i = 0; i < depth; ++i)
-		printf("  ");
-	printf("layer, pos %d,%d, dec: %d {\n", l->base.x, l->base.y,
-		l->base.decendent_views);
+	struct scene_nodes *n = &s->nodes;
+	struct scene_snapshot_cache *c = &snap->redraw[snap->num_redraw++];
+	uint32_t start = s->order_index[id] + 1;
+	uint32_t end = s->order_end[s->order_index[id]];
 
-	struct scene_node *n;
-	wl_list_for_each(n, &l->children, link) {
-		dump_node(n, depth + 1);
+	c->id = id;
+	c->bounds = n->bounds[id];
+	c->opacity = n->world_opacity[id];
+	c->first = snap->num_items;
+
+	for (uint32_t i = start; i < end; ++i) {
+		if (n->type[s->order[i]] == SCENE_NODE_VIEW)
+			snapshot_add_item(s, snap, s->order[i]);
 	}
 
-	for (int i = 0; i < depth; ++i)
-		printf("  ");
-	printf("}\n"); 
+	c->len = snap->num_items - c->first;
 }
 
 static void
-dump_view(struct scene_view *v, int depth)
+snapshot_add_dropped(struct scene_snapshot *snap, const uint32_t *ids,
+		     uint32_t len)
 {
-	for (int i = 0; i < depth; ++i)
-		printf("  ");
-	printf("view, pos %d,%d, dim %dx%d\n",
-		v->base.x, v->base.y,
-		v->width, v->height);
+	if (len == 0)
+		return;
+
+	memcpy(&snap->dropped[snap->num_dropped], ids, len * sizeof *ids);
+	snap->num_dropped += len;
 }
 
+/* Its caches get redrawn from whichever snapshot comes next */
 static void
-dump_node(struct scene_node *n, int depth)
+snapshot_invalidate_redraws(struct scene *s,
+			    const struct scene_snapshot *snap)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	for (uint32_t i = 0; i < snap->num_redraw; ++i)
+		n->flags[snap->redraw[i].id] &= ~SCENE_NODE_CACHE_VALID;
+	s->visible_valid = false;
+}
+
+/*
+ * If the renderer never took the latest snapshot, or gave one back, whatever
+ * it was told to do there gets carried over to the new one: the damage, the
+ * caches to free, and the caches to redraw, which are simply marked invalid
+ * again.
+ */
+void
+scene_publish(struct scene *s)
 {
-	switch (n->type) {
+	struct scene_nodes *n = &s->nodes;
+	struct scene_snapshot *snap, *prev = NULL, *returned = NULL;
+	uint32_t num_dropped;
+	int target;
+
+	if (s->transaction > 0)
+		return;
+
+	pthread_mutex_lock(&s->snapshot_lock);
+
+	if (s->latest >= 0 && s->returned < 0 &&
+	    s->snapshots[s->latest].generation == s->generation)
+		goto out;
+
+	if (s->latest >= 0 && !s->latest_taken) {
+		prev = &s->snapshots[s->latest];
+		snapshot_invalidate_redraws(s, prev);
+	}
+
+	if (s->returned >= 0) {
+		returned = &s->snapshots[s->returned];
+		snapshot_invalidate_redraws(s, returned);
+	}
+
+	scene_prepare(s);
+
+	/* Can't be the latest one if the renderer is holding the other */
+	target = s->latest == 0 ? 1 : 0;
+	if (target == s->in_use)
+		target = s->latest;
+	snap = &s->snapshots[target];
+
+	num_dropped = s->num_dropped_caches;
+	if (prev)
+		num_dropped += prev->num_dropped;
+	if (returned)
+		num_dropped += returned->num_dropped;
+	if (snapshot_reserve(s, snap, num_dropped) < 0)
+		goto out;
+
+	/* Anything carried over that's already in there stays put */
+	if (snap != prev && snap != returned) {
+		region_clear(&snap->damage);
+		snap->num_dropped = 0;
+	}
+
+	if (prev && prev != snap) {
+		region_union(&snap->damage, &prev->damage);
+		snapshot_add_dropped(snap, prev->dropped, prev->num_dropped);
+	}
+
+	if (returned && returned != snap) {
+		region_union(&snap->damage, &returned->damage);
+		snapshot_add_dropped(snap, returned->dropped,
+				     returned->num_dropped);
+	}
+	s->returned = -1;
+
+	snap->generation = s->generation;
+	region_union(&snap->damage, &s->damage);
+	region_clear(&s->damage);
+
+	/* Everything else in there is still the same as in s->quads */
+	snap->num_quads = s->num_slots;
+	if (s->quads_end[target] > snap->num_quads)
+		s->quads_end[target] = snap->num_quads;
+	if (s->quads_start[target] < s->quads_end[target])
+		memcpy(&snap->quads[s->quads_start[target]],
+		       &s->quads[s->quads_start[target]],
+		       (s->quads_end[target] - s->quads_start[target]) *
+		       sizeof *snap->quads);
+	s->quads_start[target] = s->quads_end[target] = 0;
+
+	transform_identity(&snap->transforms[0]);
+	memcpy(&snap->transforms[1], n->world, n->len * sizeof *n->world);
+	snap->num_transforms = n->len + 1;
+
+	snap->num_items = 0;
+	for (uint32_t i = 0; i < s->visible_len; ++i)
+		snapshot_add_item(s, snap, s->visible[i]);
+	snap->num_visible = snap->num_items;
+
+	snap->num_redraw = 0;
+	for (uint32_t i = 0; i < s->visible_len; ++i) {
+		uint32_t id = s->visible[i];
+
+		if (!(n->flags[id] & SCENE_NODE_CACHED) ||
+		    (n->flags[id] & SCENE_NODE_CACHE_VALID))
+			continue;
+
+		snapshot_add_redraw(s, snap, id);
+		/* The renderer draws it from this snapshot */
+		n->flags[id] |= SCENE_NODE_CACHE_VALID;
+	}
+
+	snapshot_add_dropped(snap, s->dropped_caches, s->num_dropped_caches);
+	s->num_dropped_caches = 0;
+
+	s->latest = target;
+	s->latest_taken = false;
+
+out:
+	pthread_mutex_unlock(&s->snapshot_lock);
+}
+
+const struct scene_snapshot *
+scene_acquire_snapshot(struct scene *s)
+{
+	const struct scene_snapshot *snap = NULL;
+
+	pthread_mutex_lock(&s->snapshot_lock);
+
+	if (s->latest >= 0) {
+		snap = &s->snapshots[s->latest];
+		s->in_use = s->latest;
+		s->latest_taken = true;
+	}
+
+	pthread_mutex_unlock(&s->snapshot_lock);
+
+	return snap;
+}
+
+void
+scene_release_snapshot(struct scene *s)
+{
+	pthread_mutex_lock(&s->snapshot_lock);
+	s->in_use = -1;
+	pthread_mutex_unlock(&s->snapshot_lock);
+}
+
+/*
+ * If it's still the latest, it's as if it was never taken. Otherwise the
+ * newer one was written without it, and the next one has to make up for
+ * that.
+ */
+void
+scene_return_snapshot(struct scene *s)
+{
+	pthread_mutex_lock(&s->snapshot_lock);
+
+	if (s->in_use == s->latest)
+		s->latest_taken = false;
+	else
+		s->returned = s->in_use;
+	s->in_use = -1;
+
+	pthread_mutex_unlock(&s->snapshot_lock);
+}
+
+struct pick {
+	struct scene *scene;
+	float x, y;
+	uint32_t best;
+};
+
+static bool
+pick_iter(uint32_t id, const struct rect *rect, void *data)
+{
+	struct pick *p = data;
+	struct scene *s = p->scene;
+	struct scene_nodes *n = &s->nodes;
+	struct transform inv;
+	float x, y;
+
+	/* The grid only knows the bounds, which is too much when rotated */
+	if (!transform_is_axis_aligned(&n->world[id])) {
+		if (!transform_invert(&inv, &n->world[id]))
+			return true;
+
+		transform_point(&inv, p->x, p->y, &x, &y);
+		if (x < 0.0f || y < 0.0f ||
+		    x >= n->width[id] || y >= n->height[id])
+			return true;
+	}
+
+	/* Later in painter's order means on top */
+	if (p->best == SCENE_NONE ||
+	    s->order_index[id] > s->order_index[p->best])
+		p->best = id;
+
+	return true;
+}
+
+struct scene_view *
+scene_pick(struct scene *s, int x, int y)
+{
+	/* The middle of the pixel */
+	struct pick p = {
+		.scene = s,
+		.x = x + 0.5f,
+		.y = y + 0.5f,
+		.best = SCENE_NONE,
+	};
+
+	scene_update(s);
+	grid_query_point(&s->grid, x, y, pick_iter, &p);
+
+	if (p.best == SCENE_NONE)
+		return NULL;
+
+	return (struct scene_view *)node_handle(&s->nodes, p.best);
+}
+
+struct query {
+	struct scene *scene;
+	scene_iter_fn fn;
+	void *data;
+};
+
+static bool
+query_iter(uint32_t id, const struct rect *rect, void *data)
+{
+	struct query *q = data;
+
+	q->fn(q->scene, id, q->data);
+	return true;
+}
+
+void
+scene_query_rect(struct scene *s, const struct rect *rect,
+		 scene_iter_fn fn, void *data)
+{
+	struct query q = {
+		.scene = s,
+		.fn = fn,
+		.data = data,
+	};
+
+	scene_update(s);
+	grid_query_rect(&s->grid, rect, query_iter, &q);
+}
+
+static void
+dump_node(struct scene *s, uint32_t id, int depth)
+{
+	struct scene_nodes *n = &s->nodes;
+
+	for (int i = 0; i < depth; ++i)
+		printf("  ");
+
+	switch (n->type[id]) {
 	case SCENE_NODE_LAYER:
-		dump_layer((struct scene_layer *)n, depth);
+		printf("layer, pos %d,%d, scale %g, rot %g, opacity %g, "
+			"dec: %u {\n", n->x[id], n->y[id], n->scale[id],
+			n->rotation[id], n->opacity[id],
+			n->decendent_views[id]);
+
+		for (uint32_t c = n->first_child[id]; c != SCENE_NONE;
+		     c = n->next[c])
+			dump_node(s, c, depth + 1);
+
+		for (int i = 0; i < depth; ++i)
+			printf("  ");
+		printf("}\n");
 		break;
 	case SCENE_NODE_VIEW:
-		dump_view((struct scene_view *)n, depth);
+		printf("view, pos %d,%d, scale %g, rot %g, opacity %g, "
+			"dim %dx%d\n",
+			n->x[id], n->y[id], n->scale[id],
+			n->rotation[id], n->opacity[id],
+			n->width[id], n->height[id]);
 		break;
 	}
 }
@@ -233,7 +1256,7 @@ dump_node(struct scene_node *n, int depth)
 void
 scene_dump(struct scene *s)
 {
-	if (!s->root)
+	if (s->root == SCENE_NONE)
 		return;
-	dump_node(s->root, 0);
+	dump_node(s, s->root, 0);
 }
@@ -3,44 +3,334 @@
 #ifndef NORI_SCENE_H
 #define NORI_SCENE_H
 
-#include <wayland-util.h>
-
-struct scene_layer;
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "grid.h"
+#include "pool.h"
+#include "quad.h"
+#include "region.h"
+#include "transform.h"
+
+struct scene;
 struct vulkan_texture;
 
+/* Used for links which don't point anywhere */
+#define SCENE_NONE UINT32_MAX
+
+/* Number of node handles allocated at once */
+#define SCENE_SLAB_SIZE 256
+
 enum scene_node_type {
 	SCENE_NODE_LAYER,
 	SCENE_NODE_VIEW,
 };
 
-struct scene_node {
-	struct wl_list link;
-	enum scene_node_type type;
+enum scene_node_flags {
+	/* Changed since the renderer last looked at it */
+	SCENE_NODE_DIRTY = 1 << 0,
+	/* Something below this node is dirty */
+	SCENE_NODE_CHILD_DIRTY = 1 << 1,
+	/* View completely covers everything below it */
+	SCENE_NODE_OPAQUE = 1 << 2,
+	/* View moved, but its quad hasn't been rewritten yet */
+	SCENE_NODE_STALE = 1 << 3,
+	/* Layer is drawn from a texture holding everything inside it */
+	SCENE_NODE_CACHED = 1 << 4,
+	/* Nothing in the layer changed since its texture was drawn */
+	SCENE_NODE_CACHE_VALID = 1 << 5,
+	/* Changed in the current transaction; in scene.pending */
+	SCENE_NODE_PENDING = 1 << 6,
+	/* Has a views_delta to pass on to its ancestors; in scene.pending_counts */
+	SCENE_NODE_COUNT_PENDING = 1 << 7,
+	/* Destroyed, but its subtree still holds slots; in scene.orphans */
+	SCENE_NODE_ORPHAN = 1 << 8,
+};
+
+/* Number of opaque rectangles remembered while looking for hidden views */
+#define SCENE_MAX_OCCLUDERS 16
 
-	struct scene_layer *parent;
-	/* Always == 1 for views, representing itself */
-	int decendent_views;
+/*
+ * Stale quads are only written on the scene's worker threads when there are
+ * at least this many, and handed out this many at a time.
+ */
+#define SCENE_PARALLEL_MIN 4096
+#define SCENE_PARALLEL_CHUNK 1024
 
-	int x;
-	int y;
+/*
+ * What users of the scene hold on to. The node's actual state lives in the
+ * scene's node arrays, indexed by id.
+ */
+struct scene_node {
+	struct scene *scene;
+	uint32_t id;
 };
 
 struct scene_layer {
 	struct scene_node base;
-
-	struct wl_list children; /* scene_node.link */
 };
 
 struct scene_view {
 	struct scene_node base;
+};
+
+/*
+ * Node state, stored as a structure of arrays indexed by node id, so
+ * walking over the nodes touches as little memory as possible.
+ */
+struct scene_nodes {
+	uint32_t len;
+	uint32_t cap;
+
+	uint8_t *type; /* enum scene_node_type */
+	uint16_t *flags; /* enum scene_node_flags */
+
+	/* Tree structure, using SCENE_NONE for missing links */
+	uint32_t *parent;
+	uint32_t *first_child;
+	uint32_t *last_child;
+	uint32_t *prev;
+	uint32_t *next;
+
+	/*
+	 * Always == 1 for views, representing itself. During a transaction,
+	 * only the parent of a node that moved is updated straight away, and
+	 * the difference is kept in views_delta until the commit.
+	 */
+	uint32_t *decendent_views;
+	int32_t *views_delta;
+
+	/*
+	 * Relative to the parent. Nodes are scaled and rotated around their
+	 * origin, then moved to their position.
+	 */
+	int32_t *x;
+	int32_t *y;
+	float *scale;
+	float *rotation; /* Radians, clockwise */
+	float *opacity;
+	/*
+	 * Maps the node's own coordinates to the scene's, and how opaque it
+	 * ends up after all of its ancestors. Valid for clean nodes attached
+	 * to the scene.
+	 */
+	struct transform *world;
+	float *world_opacity;
+	/*
+	 * Scene-space box around everything the node draws, empty if it draws
+	 * nothing. Valid for the same nodes as the world position.
+	 */
+	struct rect *bounds;
+
+	/* Only meaningful for views */
+	int32_t *width;
+	int32_t *height;
+	struct vulkan_texture **texture;
+	/*
+	 * Where this view's quad lives in the scene's quads, or where the quad
+	 * for a cached layer's texture does. Stays the same while the node is
+	 * attached to the scene, and is -1 otherwise.
+	 */
+	int32_t *slot;
+
+	/*
+	 * Handles are handed out from fixed-size slabs, so they never move;
+	 * node id N uses entry N % SCENE_SLAB_SIZE of slab N / SCENE_SLAB_SIZE.
+	 */
+	struct scene_node **slabs;
+	uint32_t num_slabs;
+
+	/*
+	 * Destroyed nodes waiting to be reused, linked through next. The
+	 * children of a destroyed layer stay linked to it and are only put on
+	 * the list once the layer itself gets reused, so destroying a subtree
+	 * doesn't have to visit all of it.
+	 */
+	uint32_t free;
+};
 
-	int width;
-	int height;
+/* Something to draw, with everything the renderer needs to know about it */
+struct scene_snapshot_item {
+	uint32_t id;
+	/* Index into the quads */
+	int32_t slot;
+	/* Index into the transforms */
+	uint32_t transform;
+	float opacity;
+	/* NULL for cached layers; the renderer keeps their textures */
 	struct vulkan_texture *texture;
 };
 
+/* A cached layer whose contents need to be drawn into its texture */
+struct scene_snapshot_cache {
+	uint32_t id;
+	/* Scene-space area the texture covers */
+	struct rect bounds;
+	float opacity;
+	/* The layer's contents, as a range of items */
+	uint32_t first;
+	uint32_t len;
+};
+
+/*
+ * Everything the renderer needs to draw the scene as it was at one point in
+ * time. Only read once published, so the renderer can work from it on a
+ * thread of its own while the scene carries on changing.
+ */
+struct scene_snapshot {
+	uint64_t generation;
+	/* Changed since the last snapshot the renderer took */
+	struct region damage;
+
+	/* Indexed by slot */
+	struct quad *quads;
+	uint32_t num_quads;
+	uint32_t quads_cap;
+
+	/*
+	 * The identity, followed by the world transform of every node, so
+	 * node id N is at N + 1.
+	 */
+	struct transform *transforms;
+	uint32_t num_transforms;
+	uint32_t transforms_cap;
+
+	/*
+	 * The first num_visible are drawn in painter's order. The contents of
+	 * the caches to redraw follow.
+	 */
+	struct scene_snapshot_item *items;
+	uint32_t num_visible;
+	uint32_t num_items;
+	uint32_t items_cap;
+
+	struct scene_snapshot_cache *redraw;
+	uint32_t num_redraw;
+	uint32_t redraw_cap;
+
+	/* Layers whose cache textures can be freed, before any redraws */
+	uint32_t *dropped;
+	uint32_t num_dropped;
+	uint32_t dropped_cap;
+};
+
 struct scene {
-	struct scene_node *root;
+	struct scene_nodes nodes;
+	uint32_t root;
+
+	/*
+	 * Every node attached to the scene in painter's order (parents before
+	 * their children), and for each entry, the index just past the end of
+	 * its subtree. Rebuilt when the tree structure changes.
+	 */
+	uint32_t *order;
+	uint32_t *order_end;
+	/*
+	 * Indexed by node id; where the node is in the order. Stale for nodes
+	 * which aren't in there anymore, so check order at that index.
+	 */
+	uint32_t *order_index;
+	/*
+	 * Scratch space for scene updates, as indices into the order, then for
+	 * the ids of views whose quads need writing.
+	 */
+	uint32_t *touched;
+	uint32_t order_len;
+	uint32_t order_cap;
+	bool order_dirty;
+
+	/* Anything entirely outside of this isn't drawn */
+	struct rect viewport;
+	bool has_viewport;
+
+	/*
+	 * Views inside the viewport which aren't hidden behind opaque views,
+	 * in painter's order. Sized like the order, and rebuilt when the
+	 * generation or viewport changes.
+	 */
+	uint32_t *visible;
+	uint32_t visible_len;
+	uint64_t visible_generation;
+	bool visible_valid;
+
+	/* Layers that stopped being cached since the last snapshot */
+	uint32_t *dropped_caches;
+	uint32_t num_dropped_caches;
+	uint32_t dropped_caches_cap;
+
+	/*
+	 * Nesting depth of scene_transaction_begin, and the nodes whose
+	 * ancestors still need to hear about changes at the commit.
+	 */
+	int transaction;
+	uint32_t *pending;
+	uint32_t num_pending;
+	uint32_t pending_cap;
+	uint32_t *pending_counts;
+	uint32_t num_pending_counts;
+	uint32_t pending_counts_cap;
+
+	/* Scene-space rectangles of attached views, for picking */
+	struct grid grid;
+
+	/* Screen area changed since the last snapshot */
+	struct region damage;
+	/* Bumped on every change that could affect what's drawn */
+	uint64_t generation;
+
+	/*
+	 * Where every view goes, indexed by slot and only rewritten for views
+	 * that changed.
+	 */
+	struct quad *quads;
+	int num_slots;
+	int slots_cap;
+	/*
+	 * Slots written since each of the snapshots last copied them, so
+	 * publishing only copies those; start == end when there are none.
+	 */
+	uint32_t quads_start[2];
+	uint32_t quads_end[2];
+
+	int *free_slots;
+	int num_free_slots;
+	int free_slots_cap;
+	/*
+	 * Destroyed nodes whose views still have slots and are still in the
+	 * grid. Handing those back means visiting the whole subtree, so it
+	 * waits for scene_update instead of making destroying slow.
+	 */
+	uint32_t *orphans;
+	uint32_t num_orphans;
+	uint32_t orphans_cap;
+
+	/*
+	 * Writes stale quads when there are lots of them. Each view has its
+	 * own slot, so they can all go at once. Created the first time it's
+	 * needed, and NULL if there's only one CPU.
+	 */
+	struct pool *pool;
+	bool pool_tried;
+	/* Picked for the CPU when the scene is created */
+	quad_write_fn write_quads;
+
+	/*
+	 * Written by scene_publish into whichever one the renderer isn't
+	 * reading. The indices are -1 when unset, and guarded by the lock.
+	 */
+	struct scene_snapshot snapshots[2];
+	int latest;
+	int in_use;
+	/* Whether the renderer has seen the latest one yet */
+	bool latest_taken;
+	/*
+	 * An older one the renderer gave back without drawing it, after the
+	 * latest was published, or -1. Its work goes into the next one.
+	 */
+	int returned;
+	pthread_mutex_t snapshot_lock;
 };
 
 struct scene *
@@ -49,28 +339,137 @@ scene_create(void);
 void
 scene_destroy(struct scene *s);
 
+/* Number of views in the scene */
 size_t
 scene_get_num_nodes(struct scene *s);
-size_t
-scene_get_vertex_size(struct scene *s);
+/*
+ * Quads of views are relative to their parent layer, so moving a layer
+ * doesn't touch them. They need the world transform with the id from
+ * scene_get_transform_id applied, unless that's SCENE_NONE.
+ */
+uint32_t
+scene_get_transform_id(struct scene *s, uint32_t id);
+
+/*
+ * Makes the current state of the scene available to the renderer. Called
+ * at the end of the outermost transaction, and by whoever wants to draw
+ * changes made outside of one. Does nothing if nothing changed. Only the
+ * quads written since the snapshot was last published get copied; the
+ * transforms and items are copied in full.
+ */
 void
-scene_get_vertex_data(struct scene *s, float *vert);
+scene_publish(struct scene *s);
+
+/*
+ * For the renderer, which may be on another thread. Gives out the latest
+ * published snapshot, or NULL if there isn't one yet, and the scene leaves
+ * it alone until it's released. Cached layers are the renderer's to draw
+ * and keep; the snapshot says which to redraw and which to free.
+ */
+const struct scene_snapshot *
+scene_acquire_snapshot(struct scene *s);
+void
+scene_release_snapshot(struct scene *s);
+/*
+ * Releases the snapshot without having drawn it, e.g. if there was no image
+ * to draw into. Whatever it asked for gets asked for again.
+ */
+void
+scene_return_snapshot(struct scene *s);
+
+/* Views entirely outside of the viewport are skipped when drawing */
+void
+scene_set_viewport(struct scene *s, const struct rect *viewport);
 
 struct scene_layer *
-scene_layer_create(void);
+scene_layer_create(struct scene *s);
 
 struct scene_view *
-scene_view_create(int width, int height);
+scene_view_create(struct scene *s, int width, int height);
 
-typedef void (*scene_iter_fn)(struct scene_view *, void *);
+/*
+ * Disconnects the node and gives it back to the scene, along with everything
+ * inside it for layers. The handles must not be used afterwards. Textures
+ * are not owned by the scene and are left alone.
+ */
+void
+scene_view_destroy(struct scene_view *v);
+void
+scene_layer_destroy(struct scene_layer *l);
+
+/* Called with the id of every view, in painter's order */
+typedef void (*scene_iter_fn)(struct scene *, uint32_t, void *);
 void
 scene_for_each(struct scene *s, scene_iter_fn fn, void *data);
 
+/*
+ * Like scene_for_each, but skips views hidden behind opaque views. Cached
+ * layers are reported in place of everything inside them.
+ */
+void
+scene_for_each_visible(struct scene *s, scene_iter_fn fn, void *data);
+
+/*
+ * For layers that stop being cached. The next snapshot tells the renderer
+ * to free the layer's texture.
+ */
+void
+scene_layer_drop_cache(struct scene *s, uint32_t id);
+
+/* Gives back the slots of everything destroyed since the last call */
+void
+scene_free_orphans(struct scene *s);
+
 void
 scene_dump(struct scene *s);
 
+/* Topmost view at the scene-space point, or NULL */
+struct scene_view *
+scene_pick(struct scene *s, int x, int y);
+/* Called with the id of every view overlapping rect, in no particular order */
+void
+scene_query_rect(struct scene *s, const struct rect *rect,
+		 scene_iter_fn fn, void *data);
+
+uint64_t
+scene_get_generation(struct scene *s);
+
+/* Since the last snapshot */
+const struct region *
+scene_get_damage(struct scene *s);
+
+/* Relative to the parent, before scale and rotation */
+void
+scene_get_pos_view(struct scene_view *v, int *x, int *y);
+void
+scene_get_pos_layer(struct scene_layer *l, int *x, int *y);
+
+#define scene_get_pos(n, x, y) _Generic((n), \
+	struct scene_view *: scene_get_pos_view, \
+	struct scene_layer *: scene_get_pos_layer)((n), (x), (y))
+
 /* Scene operations */
 
+/*
+ * Groups scene operations together, so the work every operation does on
+ * the node's ancestors (counting views, marking them dirty, finding out
+ * what's damaged) is done once for the whole group at the commit. Meant for
+ * adding lots of nodes at once. Transactions can be nested, and the scene
+ * shouldn't be drawn or queried until the outermost one is committed.
+ * Committing that publishes a snapshot for the renderer.
+ */
+void
+scene_transaction_begin(struct scene *s);
+void
+scene_transaction_commit(struct scene *s);
+
+/*
+ * Brings world transforms and bounds up to date. Happens on its own when
+ * anything needs them.
+ */
+void
+scene_update(struct scene *s);
+
 void
 scene_disconnect_view(struct scene_view *v);
 void
@@ -111,9 +510,73 @@ scene_set_pos_view(struct scene_view *v, int x, int y);
 void
 scene_set_pos_layer(struct scene_layer *l, int x, int y);
 
+void
+scene_set_scale_view(struct scene_view *v, float scale);
+void
+scene_set_scale_layer(struct scene_layer *l, float scale);
+
+/* In radians, clockwise around the node's position */
+void
+scene_set_rotation_view(struct scene_view *v, float rotation);
+void
+scene_set_rotation_layer(struct scene_layer *l, float rotation);
+
+/* Multiplies the opacity of everything inside it, from 0 to 1 */
+void
+scene_set_opacity_view(struct scene_view *v, float opacity);
+void
+scene_set_opacity_layer(struct scene_layer *l, float opacity);
+
+void
+scene_view_set_texture(struct scene_view *v, struct vulkan_texture *texture);
+/*
+ * Promises that the view's texture has no transparent parts, so nothing
+ * below it needs to be drawn.
+ */
+void
+scene_view_set_opaque(struct scene_view *v, bool opaque);
+/*
+ * Draws the layer into a texture once, and then just that texture until
+ * something inside of it changes. Moving the layer by whole pixels or
+ * changing its opacity is free, but scaling or rotating it means drawing it
+ * again. Meant for small things that rarely change, like blocks of text.
+ */
+void
+scene_layer_set_cached(struct scene_layer *l, bool cached);
+
+enum scene_op_type {
+	SCENE_OP_PUSH,
+	SCENE_OP_ABOVE,
+	SCENE_OP_BELOW,
+	SCENE_OP_SET_POS,
+	SCENE_OP_DISCONNECT,
+	SCENE_OP_SET_TEXTURE,
+};
+
+/*
+ * One of the operations above, written down so it can be handed to the
+ * thread owning the scene; see scene-queue.h. For SCENE_OP_PUSH, rel is the
+ * parent layer, and SCENE_OP_SET_TEXTURE is only for views.
+ */
+struct scene_op {
+	enum scene_op_type type;
+	struct scene_node *node;
+	union {
+		struct scene_node *rel;
+		struct {
+			int32_t x;
+			int32_t y;
+		} pos;
+		struct vulkan_texture *texture;
+	};
+};
+
+void
+scene_apply_op(struct scene *s, const struct scene_op *op);
+
 #define scene_disconnect(n) _Generic((n), \
-	struct scene_view *: scene_disconnect_view(n), \
-	struct scene_layer *: scene_disconnect_layer(n))
+	struct scene_view *: scene_disconnect_view, \
+	struct scene_layer *: scene_disconnect_layer)(n)
 
 #define scene_set_root(s, n) _Generic((n), \
 	struct scene_view *: scene_set_root_view, \
@@ -151,4 +614,16 @@ scene_set_pos_layer(struct scene_layer *l, int x, int y);
 	struct scene_view *: scene_set_pos_view, \
 	struct scene_layer *: scene_set_pos_layer)((n), (x), (y))
 
+#define scene_set_scale(n, scale) _Generic((n), \
+	struct scene_view *: scene_set_scale_view, \
+	struct scene_layer *: scene_set_scale_layer)((n), (scale))
+
+#define scene_set_rotation(n, rotation) _Generic((n), \
+	struct scene_view *: scene_set_rotation_view, \
+	struct scene_layer *: scene_set_rotation_layer)((n), (rotation))
+
+#define scene_set_opacity(n, opacity) _Generic((n), \
+	struct scene_view *: scene_set_opacity_view, \
+	struct scene_layer *: scene_set_opacity_layer)((n), (opacity))
+
 #endif
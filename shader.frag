@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: MIT */
 
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
 /*
  * The vulkan spec says the minimum for maxPerStageDescriptorSampledImages
  * is 16, but I think it's MUCH higher on real implementations.
@@ -8,14 +9,23 @@
 layout(constant_id = 0) const int MAX_TEXTURES = 16;
 
 layout(location = 0) in vec2 tex_coord;
+/* Differs between instances in the same draw */
+layout(location = 1) flat in int tex_id;
+layout(location = 2) flat in float opacity;
+/* Layer caches are premultiplied, views aren't */
+layout(location = 3) flat in uint premultiplied;
 layout(location = 0) out vec4 out_color;
 
 layout(set = 0, binding = 0) uniform sampler s;
-layout(set = 0, binding = 2) uniform texture2D tex[MAX_TEXTURES];
-layout(push_constant) uniform block {
-	int tex_id;
-};
+/* Every texture there is, by slot */
+layout(set = 1, binding = 0) uniform texture2D tex[MAX_TEXTURES];
 
 void main() {
-	out_color = texture(sampler2D(tex[tex_id], s), tex_coord);
+	vec4 color = texture(sampler2D(tex[nonuniformEXT(tex_id)], s),
+			     tex_coord);
+
+	if (premultiplied == 0u)
+		color.rgb *= color.a;
+
+	out_color = color * opacity;
 }
@@ -2,17 +2,64 @@
 
 #version 450
 
-layout(location = 0) in vec2 position;
-layout(location = 1) in vec2 tex_coord_in;
+/* Matches struct vulkan_instance in vulkan.h */
+layout(location = 0) in vec2 origin;
+/* The quad's top edge, then its left edge */
+layout(location = 1) in vec4 edges;
+layout(location = 2) in vec4 uv_rect;
+layout(location = 3) in uint transform_id;
+layout(location = 4) in uint tex_id_in;
+layout(location = 5) in float opacity_in;
+
 layout(location = 0) out vec2 tex_coord_out;
+layout(location = 1) flat out int tex_id_out;
+layout(location = 2) flat out float opacity_out;
+layout(location = 3) flat out uint premultiplied_out;
 
 layout(set = 0, binding = 1) uniform block {
 	mat3 mat;
 };
 
+/* Matches struct transform in transform.h */
+struct transform {
+	float xx, xy;
+	float yx, yy;
+	float x0, y0;
+};
+/* Entry 0 is the identity, then each node's world transform by id */
+layout(std430, set = 0, binding = 3) readonly buffer transform_block {
+	transform transforms[];
+};
+
+layout(push_constant) uniform push_block {
+	/*
+	 * Moves and scales the scene before projecting it, e.g. to fit a
+	 * layer into its cache.
+	 */
+	vec2 translate;
+	vec2 scale;
+};
+
+/* Top left, top right, bottom right, then bottom right, bottom left, top left */
+const vec2 corners[6] = vec2[](
+	vec2(0.0, 0.0), vec2(1.0, 0.0), vec2(1.0, 1.0),
+	vec2(1.0, 1.0), vec2(0.0, 1.0), vec2(0.0, 0.0)
+);
+
 void main() {
-	tex_coord_out = tex_coord_in;
+	vec2 corner = corners[gl_VertexIndex];
+	vec2 position = origin + edges.xy * corner.x + edges.zw * corner.y;
+
+	transform t = transforms[transform_id];
+	vec2 world = vec2(t.xx * position.x + t.xy * position.y + t.x0,
+			  t.yx * position.x + t.yy * position.y + t.y0);
+
+	tex_coord_out = mix(uv_rect.xy, uv_rect.zw, corner);
+	/* The top bit is VULKAN_INSTANCE_PREMULTIPLIED */
+	tex_id_out = int(tex_id_in & 0x7fffu);
+	premultiplied_out = tex_id_in >> 15;
+	opacity_out = opacity_in;
 
-	vec3 pos = mat * vec3(position, 1.0);
+	vec3 pos = mat * vec3((world + translate) * scale, 1.0);
 	gl_Position = vec4(pos.xy, 0.0, 1.0);
 }
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: MIT */
+
+#include "transform.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+void
+transform_init(struct transform *t, float x, float y,
+	       float scale, float rotation)
+{
+	float c = 1.0f, s = 0.0f;
+
+	/* Keep the common case exact */
+	if (rotation != 0.0f) {
+		c = cosf(rotation);
+		s = sinf(rotation);
+	}
+
+	*t = (struct transform) {
+		.xx = c * scale,
+		.xy = -s * scale,
+		.yx = s * scale,
+		.yy = c * scale,
+		.x0 = x,
+		.y0 = y,
+	};
+}
+
+void
+transform_multiply(struct transform *out, const struct transform *a,
+		   const struct transform *b)
+{
+	struct transform t = {
+		.xx = a->xx * b->xx + a->xy * b->yx,
+		.xy = a->xx * b->xy + a->xy * b->yy,
+		.yx = a->yx * b->xx + a->yy * b->yx,
+		.yy = a->yx * b->xy + a->yy * b->yy,
+		.x0 = a->xx * b->x0 + a->xy * b->y0 + a->x0,
+		.y0 = a->yx * b->x0 + a->yy * b->y0 + a->y0,
+	};
+
+	*out = t;
+}
+
+bool
+transform_invert(struct transform *out, const struct transform *t)
+{
+	float det = t->xx * t->yy - t->xy * t->yx;
+	struct transform inv;
+
+	if (det == 0.0f)
+		return false;
+
+	inv.xx = t->yy / det;
+	inv.xy = -t->xy / det;
+	inv.yx = -t->yx / det;
+	inv.yy = t->xx / det;
+	inv.x0 = -(inv.xx * t->x0 + inv.xy * t->y0);
+	inv.y0 = -(inv.yx * t->x0 + inv.yy * t->y0);
+
+	*out = inv;
+	return true;
+}
+
+void
+transform_point(const struct transform *t, float x, float y,
+		float *out_x, float *out_y)
+{
+	*out_x = t->xx * x + t->xy * y + t->x0;
+	*out_y = t->yx * x + t->yy * y + t->y0;
+}
+
+void
+transform_box(const struct transform *t, float width, float height,
+	      struct rect *out)
+{
+	const float corners[4][2] = {
+		{ 0.0f, 0.0f },
+		{ width, 0.0f },
+		{ width, height },
+		{ 0.0f, height },
+	};
+	float x1 = INFINITY, y1 = INFINITY;
+	float x2 = -INFINITY, y2 = -INFINITY;
+
+	for (int i = 0; i < 4; ++i) {
+		float x, y;
+
+		transform_point(t, corners[i][0], corners[i][1], &x, &y);
+		x1 = fminf(x1, x);
+		y1 = fminf(y1, y);
+		x2 = fmaxf(x2, x);
+		y2 = fmaxf(y2, y);
+	}
+
+	out->x = (int32_t)floorf(x1);
+	out->y = (int32_t)floorf(y1);
+	out->width = (int32_t)ceilf(x2) - out->x;
+	out->height = (int32_t)ceilf(y2) - out->y;
+}
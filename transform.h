@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: MIT */
+
+#ifndef NORI_TRANSFORM_H
+#define NORI_TRANSFORM_H
+
+#include <stdbool.h>
+
+#include "region.h"
+
+/*
+ * A 2D affine transform, mapping (x, y) to
+ * (xx * x + xy * y + x0, yx * x + yy * y + y0).
+ */
+struct transform {
+	float xx, xy;
+	float yx, yy;
+	float x0, y0;
+};
+
+static inline void
+transform_identity(struct transform *t)
+{
+	*t = (struct transform) { .xx = 1.0f, .yy = 1.0f };
+}
+
+/* Scales, then rotates (in radians, clockwise), then translates */
+void
+transform_init(struct transform *t, float x, float y,
+	       float scale, float rotation);
+
+/* out = a * b, i.e. b is applied first. out may alias either of them. */
+void
+transform_multiply(struct transform *out, const struct transform *a,
+		   const struct transform *b);
+
+/* False if t isn't invertible, e.g. because it's scaled to nothing */
+bool
+transform_invert(struct transform *out, const struct transform *t);
+
+void
+transform_point(const struct transform *t, float x, float y,
+		float *out_x, float *out_y);
+
+/* Smallest whole-pixel rectangle containing the transformed w x h box */
+void
+transform_box(const struct transform *t, float width, float height,
+	      struct rect *out);
+
+/* Whether rectangles stay rectangles with edges along the axes */
+static inline bool
+transform_is_axis_aligned(const struct transform *t)
+{
+	return t->xy == 0.0f && t->yx == 0.0f;
+}
+
+#endif
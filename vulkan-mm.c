@@ -3,9 +3,22 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
 
+/* Everything a frame streams shares one buffer */
+#define STREAM_USAGE (VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | \
+		      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | \
+		      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | \
+		      VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | \
+		      VK_BUFFER_USAGE_TRANSFER_SRC_BIT)
+
+/* Copied into from the ring, and into bigger ones when they grow */
+#define RESIDENT_USAGE (VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | \
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT | \
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT)
+
 /*
  * Vulkan implementations are supposed to order the memory types based on what
  * they think is the most efficient, which this takes advantage of.
@@ -25,23 +38,30 @@ static const uint32_t staging_reqs = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
  */
 static const uint32_t vram_reqs = 0;
 
-/* Used by both "vertex" and "index" types */
+/* Used by the "resident" type */
+static const uint32_t resident_reqs[] = {
+	/* Read every frame, but hardly ever written */
+	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+	0,
+};
+
+/*
+ * Used by the "stream" type.
+ * The ring is written through its mapping and never flushed, so it has to
+ * be coherent. The spec guarantees every buffer can use at least one type
+ * that is.
+ */
 static const uint32_t stream_reqs[] = {
 	/*
 	 * Best if no extra copying steps needs to happen.
 	 * AMD has some special "streaming" type that satisfies this.
 	 */
-	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-	/*
-	 * Prefer the GPU can just read from the CPU instead of transferring,
-	 * since we're only using it once.
-	 */
-	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-	/*
-	 * Just take what we can get; we'll have to transfer from a staging
-	 * buffer.
-	 */
-	0,
+	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	/* The GPU just reads from the CPU, since we're only using it once */
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 };
 
 /* Select the best memory type based on how we indend to use it. */
@@ -148,19 +168,23 @@ vulkan_mm_setup_types(struct vulkan *vk)
 
 	vkGetPhysicalDeviceMemoryProperties(vk->physical_device, &props);
 
+	for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; ++i) {
+		wl_list_init(&vk->buffer_heaps[i].blocks);
+		wl_list_init(&vk->image_heaps[i].blocks);
+	}
+	pthread_mutex_init(&vk->mm_lock, NULL);
+
 	if (get_buf_type(vk, &props, 1, &staging_reqs,
 			 VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 			 &vk->staging_type) < 0)
 		return -1;
 
 	if (get_buf_type(vk, &props, ARRAY_LEN(stream_reqs), stream_reqs,
-			 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-			 &vk->uniform_type) < 0)
+			 STREAM_USAGE, &vk->stream_type) < 0)
 		return -1;
 
-	if (get_buf_type(vk, &props, ARRAY_LEN(stream_reqs), stream_reqs,
-			 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-			 &vk->vertex_type) < 0)
+	if (get_buf_type(vk, &props, ARRAY_LEN(resident_reqs), resident_reqs,
+			 RESIDENT_USAGE, &vk->resident_type) < 0)
 		return -1;
 
 	res = vkCreateImage(vk->logical_device, &image_info, NULL, &dummy_img);
@@ -172,8 +196,8 @@ vulkan_mm_setup_types(struct vulkan *vk)
 
 	printf("- Staging type: %u\n", vk->staging_type);
 	printf("- Texture type: %u\n", vk->texture_type);
-	printf("- Uniform type: %u\n", vk->uniform_type);
-	printf("- Vertex type: %u\n", vk->vertex_type);
+	printf("- Stream type: %u\n", vk->stream_type);
+	printf("- Resident type: %u\n", vk->resident_type);
 
 	return 0;
 
@@ -280,11 +304,184 @@ err_free:
 static void
 free_memory(struct vulkan *vk, struct vulkan_memory *m)
 {
-	vkUnmapMemory(vk->logical_device, m->memory);
+	if (m->data)
+		vkUnmapMemory(vk->logical_device, m->memory);
 	vkFreeMemory(vk->logical_device, m->memory, NULL);
+	free(m->tree);
 	free(m);
 }
 
+/*
+ * Tree entries at depth d cover pieces of order VULKAN_MM_BLOCK_ORDER - d,
+ * starting at entry (1 << d) - 1.
+ */
+#define TREE_LEN ((1u << VULKAN_MM_NUM_ORDERS) - 1)
+
+static uint32_t
+tree_first(int order)
+{
+	return (1u << (VULKAN_MM_BLOCK_ORDER - order)) - 1;
+}
+
+/* After the entry for a piece of this order changed */
+static void
+tree_update(uint8_t *tree, uint32_t i, int order)
+{
+	while (i > 0) {
+		uint32_t parent = (i - 1) / 2;
+		uint8_t left = tree[2 * parent + 1];
+		uint8_t right = tree[2 * parent + 2];
+
+		/* Buddies which are both free merge back together */
+		if (left == order + 1 && right == order + 1)
+			tree[parent] = order + 2;
+		else
+			tree[parent] = left > right ? left : right;
+
+		i = parent;
+		++order;
+	}
+}
+
+/* The offset of a free piece of this order, or -1 if there's none */
+static int64_t
+tree_alloc(uint8_t *tree, int order)
+{
+	uint32_t i = 0;
+
+	if (tree[0] < order + 1)
+		return -1;
+
+	for (int o = VULKAN_MM_BLOCK_ORDER; o > order; --o) {
+		i = 2 * i + 1;
+		if (tree[i] < order + 1)
+			++i;
+	}
+
+	tree[i] = 0;
+	tree_update(tree, i, order);
+
+	return (int64_t)(i - tree_first(order)) << order;
+}
+
+static void
+tree_free(uint8_t *tree, uint64_t offset, int order)
+{
+	uint32_t i = tree_first(order) + (uint32_t)(offset >> order);
+
+	tree[i] = order + 1;
+	tree_update(tree, i, order);
+}
+
+static struct vulkan_memory *
+alloc_block(struct vulkan *vk, uint32_t index, unsigned opts)
+{
+	struct vulkan_memory *m;
+	const VkMemoryRequirements2 req = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+		.memoryRequirements = {
+			.size = (uint64_t)1 << VULKAN_MM_BLOCK_ORDER,
+			.memoryTypeBits = 1u << index,
+		},
+	};
+
+	m = allocate_memory(vk, &req, index, opts);
+	if (!m)
+		return NULL;
+
+	m->ref = 0;
+	m->tree = malloc(TREE_LEN);
+	if (!m->tree) {
+		free_memory(vk, m);
+		return NULL;
+	}
+
+	/* Every piece starts out free */
+	for (int o = VULKAN_MM_BLOCK_ORDER; o >= VULKAN_MM_MIN_ORDER; --o)
+		memset(&m->tree[tree_first(o)], o + 1,
+		       (size_t)1 << (VULKAN_MM_BLOCK_ORDER - o));
+
+	return m;
+}
+
+/*
+ * Finds memory for a buffer or image. Big ones get their own, and the rest
+ * get a piece of a block, with order set to its size.
+ */
+static struct vulkan_memory *
+alloc_piece(struct vulkan *vk, struct vulkan_heap *heap,
+	    const VkMemoryRequirements2 *req, uint32_t index, unsigned opts,
+	    uint64_t *offset, int *order)
+{
+	const VkMemoryRequirements *r = &req->memoryRequirements;
+	struct vulkan_memory *m;
+	int64_t pos = -1;
+	int o = VULKAN_MM_MIN_ORDER;
+
+	while (((uint64_t)1 << o) < r->size || ((uint64_t)1 << o) < r->alignment)
+		++o;
+
+	if (o > VULKAN_MM_MAX_ORDER) {
+		m = allocate_memory(vk, req, index, opts);
+		if (!m)
+			return NULL;
+
+		m->dedicated = true;
+		*offset = 0;
+		*order = 0;
+		return m;
+	}
+
+	pthread_mutex_lock(&vk->mm_lock);
+
+	wl_list_for_each(m, &heap->blocks, link) {
+		pos = tree_alloc(m->tree, o);
+		if (pos >= 0)
+			break;
+	}
+
+	if (pos < 0) {
+		m = alloc_block(vk, index, opts);
+		if (!m) {
+			pthread_mutex_unlock(&vk->mm_lock);
+			return NULL;
+		}
+
+		wl_list_insert(&heap->blocks, &m->link);
+		pos = tree_alloc(m->tree, o);
+	}
+
+	++m->ref;
+
+	pthread_mutex_unlock(&vk->mm_lock);
+
+	*offset = pos;
+	*order = o;
+	return m;
+}
+
+static void
+free_piece(struct vulkan *vk, struct vulkan_memory *m,
+	   uint64_t offset, int order)
+{
+	if (m->dedicated) {
+		free_memory(vk, m);
+		return;
+	}
+
+	pthread_mutex_lock(&vk->mm_lock);
+
+	tree_free(m->tree, offset, order);
+
+	/* Keep the last block around, so we don't keep reallocating it */
+	if (--m->ref == 0 && (m->link.next != m->link.prev)) {
+		wl_list_remove(&m->link);
+		free_memory(vk, m);
+	}
+
+	pthread_mutex_unlock(&vk->mm_lock);
+}
+
 static int
 alloc_buffer(struct vulkan *vk, struct vulkan_buffer *b, size_t size,
 	     int index, VkBufferUsageFlags usage)
@@ -303,12 +500,13 @@ alloc_buffer(struct vulkan *vk, struct vulkan_buffer *b, size_t size,
 
 	vkGetBufferMemoryRequirements2(vk->logical_device, &info, &req);
 
-	b->mem = allocate_memory(vk, &req, index, 0);
+	b->mem = alloc_piece(vk, &vk->buffer_heaps[index], &req, index, 0,
+			     &b->offset, &b->order);
 	if (!b->mem)
 		goto err_buf;
 
 	b->size = size;
-	b->offset = 0;
+	b->data = b->mem->data ? (char *)b->mem->data + b->offset : NULL;
 
 	if (bind_buffer(vk, b) < 0)
 		goto err_mem;
@@ -316,7 +514,7 @@ alloc_buffer(struct vulkan *vk, struct vulkan_buffer *b, size_t size,
 	return 0;
 
 err_mem:
-	free_memory(vk, b->mem);
+	free_piece(vk, b->mem, b->offset, b->order);
 err_buf:
 	vkDestroyBuffer(vk->logical_device, b->buffer, NULL);
 	b->buffer = VK_NULL_HANDLE;
@@ -332,24 +530,85 @@ vulkan_mm_alloc_staging_buffer(struct vulkan *vk, struct vulkan_buffer *b,
 }
 
 int
-vulkan_mm_alloc_uniform_buffer(struct vulkan *vk, struct vulkan_buffer *b,
-			       size_t size)
+vulkan_mm_alloc_resident_buffer(struct vulkan *vk, struct vulkan_buffer *b,
+				size_t size)
 {
-	return alloc_buffer(vk, b, size, vk->uniform_type,
-			    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+	return alloc_buffer(vk, b, size, vk->resident_type, RESIDENT_USAGE);
+}
+
+static uint64_t
+align_up(uint64_t value, uint64_t align)
+{
+	return (value + align - 1) / align * align;
+}
+
+/* Replaces the buffer with one that fits a few frames of size bytes */
+static int
+ring_grow(struct vulkan *vk, struct vulkan_ring *ring, uint64_t size,
+	  struct vulkan_buffer *retired)
+{
+	struct vulkan_buffer b;
+	uint64_t cap = ring->buffer.size ? ring->buffer.size * 2 :
+		VULKAN_RING_MIN_SIZE;
+
+	while (cap < 3 * size)
+		cap *= 2;
+
+	if (alloc_buffer(vk, &b, cap, vk->stream_type, STREAM_USAGE) < 0)
+		return -1;
+
+	/* Earlier frames are still reading the old one */
+	assert(retired->buffer == VK_NULL_HANDLE);
+	*retired = ring->buffer;
+
+	ring->buffer = b;
+	ring->head = 0;
+	ring->tail = 0;
+	++ring->generation;
+
+	return 0;
 }
 
 int
-vulkan_mm_alloc_vertex_buffer(struct vulkan *vk, struct vulkan_buffer *b,
-			      size_t size)
+vulkan_mm_ring_alloc(struct vulkan *vk, struct vulkan_ring *ring,
+		     uint64_t size, uint64_t *offset,
+		     struct vulkan_buffer *retired)
 {
-	return alloc_buffer(vk, b, size, vk->vertex_type,
-			    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+	uint64_t cap = ring->buffer.size;
+	uint64_t head = align_up(ring->head, vk->stream_align);
+	uint64_t pos;
+
+	/* Doesn't wrap around in the middle, so skip to the start instead */
+	if (cap > 0 && head % cap + size > cap)
+		head += cap - head % cap;
+
+	if (cap == 0 || head + size - ring->tail > cap) {
+		if (ring_grow(vk, ring, size, retired) < 0)
+			return -1;
+
+		cap = ring->buffer.size;
+		head = 0;
+	}
+
+	pos = head % cap;
+	ring->head = head + size;
+	*offset = pos;
+
+	return 0;
+}
+
+void
+vulkan_mm_ring_release(struct vulkan_ring *ring, uint32_t generation,
+		       uint64_t end)
+{
+	if (generation == ring->generation && end > ring->tail)
+		ring->tail = end;
 }
 
 struct vulkan_texture *
 vulkan_mm_alloc_texture(struct vulkan *vk, VkFormat format,
-			int width, int height, const VkComponentMapping *mapping)
+			int width, int height, const VkComponentMapping *mapping,
+			VkImageUsageFlags usage)
 {
 	VkResult res;
 	struct vulkan_texture *t;
@@ -368,8 +627,7 @@ vulkan_mm_alloc_texture(struct vulkan *vk, VkFormat format,
 		.arrayLayers = 1,
 		.samples = VK_SAMPLE_COUNT_1_BIT,
 		.tiling = VK_IMAGE_TILING_OPTIMAL,
-		.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
-			 VK_IMAGE_USAGE_SAMPLED_BIT,
+		.usage = usage,
 		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
 		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
 	};
@@ -377,7 +635,11 @@ vulkan_mm_alloc_texture(struct vulkan *vk, VkFormat format,
 	t = calloc(1, sizeof *t);
 	if (!t)
 		return NULL;
-	
+
+	wl_list_init(&t->link);
+	t->width = width;
+	t->height = height;
+
 	res = vkCreateImage(vk->logical_device, &img_info, NULL, &t->image);
 	if (res < 0) {
 		fprintf(stderr, "vkCreateImage: 0x%x\n", res);
@@ -397,7 +659,9 @@ vulkan_mm_alloc_texture(struct vulkan *vk, VkFormat format,
 	 * with transitioning to VK_IMAGE_TILING_OPTIMAL, so we just always
 	 * go through a staging buffer and perform a transfer command.
 	 */
-	t->mem = allocate_memory(vk, &req, vk->texture_type, ALLOC_NO_MAP);
+	t->mem = alloc_piece(vk, &vk->image_heaps[vk->texture_type], &req,
+			     vk->texture_type, ALLOC_NO_MAP,
+			     &t->offset, &t->order);
 	if (!t->mem)
 		goto err_img;
 
@@ -405,7 +669,7 @@ vulkan_mm_alloc_texture(struct vulkan *vk, VkFormat format,
 		.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO,
 		.image = t->image,
 		.memory = t->mem->memory,
-		.memoryOffset = 0,
+		.memoryOffset = t->offset,
 	};
 
 	res = vkBindImageMemory2(vk->logical_device, 1, &bind_info);
@@ -435,11 +699,15 @@ vulkan_mm_alloc_texture(struct vulkan *vk, VkFormat format,
 		goto err_mem;
 	}
 
+	if (vulkan_renderpass_add_texture(vk, t) < 0)
+		goto err_view;
 
 	return t;
 
+err_view:
+	vkDestroyImageView(vk->logical_device, t->view, NULL);
 err_mem:
-	free_memory(vk, t->mem);
+	free_piece(vk, t->mem, t->offset, t->order);
 err_img:
 	vkDestroyImage(vk->logical_device, t->image, NULL);
 err_free:
@@ -447,14 +715,30 @@ err_free:
 	return NULL;
 }
 
+void
+vulkan_mm_free_texture(struct vulkan *vk, struct vulkan_texture *t)
+{
+	wl_list_remove(&t->link);
+	vulkan_renderpass_remove_texture(vk, t);
+
+	if (t->framebuffer != VK_NULL_HANDLE)
+		vkDestroyFramebuffer(vk->logical_device, t->framebuffer, NULL);
+	vkDestroyImageView(vk->logical_device, t->view, NULL);
+	vkDestroyImage(vk->logical_device, t->image, NULL);
+	free_piece(vk, t->mem, t->offset, t->order);
+	free(t);
+}
+
 void
 vulkan_mm_free_buffer(struct vulkan *vk, struct vulkan_buffer *b)
 {
 	vkDestroyBuffer(vk->logical_device, b->buffer, NULL);
-	free_memory(vk, b->mem);
+	free_piece(vk, b->mem, b->offset, b->order);
 
 	b->buffer = VK_NULL_HANDLE;
 	b->mem = NULL;
 	b->offset = 0;
 	b->size = 0;
+	b->data = NULL;
+	b->order = 0;
 }
@@ -4,9 +4,12 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_wayland.h>
@@ -14,6 +17,7 @@
 
 #include "shader.vert.h"
 #include "shader.frag.h"
+#include "cull.comp.h"
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
 
@@ -82,6 +86,80 @@ create_renderpass(struct vulkan *vk,
 	return 0;
 }
 
+/*
+ * Layer caches start out cleared, and end up being sampled. Only the layouts
+ * and load op differ from the main render pass, so they're compatible and
+ * can share pipelines.
+ */
+static int
+create_cache_renderpass(struct vulkan *vk,
+			struct vulkan_renderpass *rp)
+{
+	VkResult res;
+	static const VkAttachmentDescription attachment = {
+		.flags = 0,
+		.format = VK_FORMAT_B8G8R8A8_UNORM,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+		.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+		.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+		.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+	};
+
+	static const VkAttachmentReference attach_ref = {
+		.attachment = 0,
+		.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+	};
+	static const VkSubpassDescription subpass = {
+		.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+		.colorAttachmentCount = 1,
+		.pColorAttachments = &attach_ref,
+	};
+
+	static const VkSubpassDependency deps[] = {
+		/* Earlier frames may still be sampling the old contents */
+		{
+			.srcSubpass = VK_SUBPASS_EXTERNAL,
+			.dstSubpass = 0,
+			.srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+			.srcAccessMask = 0,
+			.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+		},
+		/* And the main render pass samples the new ones */
+		{
+			.srcSubpass = 0,
+			.dstSubpass = VK_SUBPASS_EXTERNAL,
+			.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+			.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+		},
+	};
+
+	static const VkRenderPassCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+		.attachmentCount = 1,
+		.pAttachments = &attachment,
+		.subpassCount = 1,
+		.pSubpasses = &subpass,
+		.dependencyCount = ARRAY_LEN(deps),
+		.pDependencies = deps,
+	};
+
+	res = vkCreateRenderPass(vk->logical_device, &info, NULL,
+				 &rp->cache_renderpass);
+	if (res < 0) {
+		fprintf(stderr, "vkCreateRenderPass: 0x%x\n",
+			res);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 create_sampler(struct vulkan *vk, struct vulkan_renderpass *rp)
 {
@@ -116,11 +194,6 @@ static int
 create_pipeline_layout(struct vulkan *vk, struct vulkan_renderpass *rp)
 {
 	VkResult res;
-	static const VkDescriptorBindingFlags desc_flags[] = {
-		0,
-		0,
-		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT,
-	};
 	const VkDescriptorSetLayoutBinding desc_bindings[] = {
 		{
 			.binding = 0,
@@ -136,23 +209,42 @@ create_pipeline_layout(struct vulkan *vk, struct vulkan_renderpass *rp)
 			.stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
 		},
 		{
-			.binding = 2,
-			.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
-			.descriptorCount = vk->max_textures,
-			.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+			.binding = 3,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_VERTEX_BIT |
+				VK_SHADER_STAGE_COMPUTE_BIT,
+		},
+		/* Instances, culled instances, then draws */
+		{
+			.binding = 4,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		},
+		{
+			.binding = 5,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		},
+		{
+			.binding = 6,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		},
+		/* Which instances each pass draws */
+		{
+			.binding = 7,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
 		},
 	};
 
-	static_assert(ARRAY_LEN(desc_flags) == ARRAY_LEN(desc_bindings));
-
-	static const VkDescriptorSetLayoutBindingFlagsCreateInfo binding_info = {
-		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
-		.bindingCount = ARRAY_LEN(desc_flags),
-		.pBindingFlags = desc_flags,
-	};
 	const VkDescriptorSetLayoutCreateInfo desc_layout_info = {
 		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-		.pNext = &binding_info,
 		.bindingCount = ARRAY_LEN(desc_bindings),
 		.pBindings = desc_bindings,
 	};
@@ -165,15 +257,52 @@ create_pipeline_layout(struct vulkan *vk, struct vulkan_renderpass *rp)
 		return -1;
 	}
 
-	static const VkPushConstantRange range = {
+	/* Slots nobody has yet are left unwritten */
+	static const VkDescriptorBindingFlags tex_flags =
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+		VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+	static const VkDescriptorSetLayoutBindingFlagsCreateInfo tex_flags_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+		.bindingCount = 1,
+		.pBindingFlags = &tex_flags,
+	};
+	const VkDescriptorSetLayoutBinding tex_binding = {
+		.binding = 0,
+		.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+		.descriptorCount = vk->max_textures,
 		.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+	};
+	const VkDescriptorSetLayoutCreateInfo tex_layout_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.pNext = &tex_flags_info,
+		.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+		.bindingCount = 1,
+		.pBindings = &tex_binding,
+	};
+
+	res = vkCreateDescriptorSetLayout(vk->logical_device,
+					  &tex_layout_info,
+					  NULL, &rp->tex_layout);
+	if (res < 0) {
+		fprintf(stderr, "vkCreateDescriptorSetLayout: 0x%x\n", res);
+		return -1;
+	}
+
+	/* Just the translate and scale for the whole pass */
+	static const VkPushConstantRange range = {
+		.stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
 		.offset = 0,
-		.size = sizeof(int32_t),
+		.size = sizeof(float[4]),
+	};
+	/* Per-frame data, then the textures */
+	const VkDescriptorSetLayout set_layouts[] = {
+		rp->desc_layout,
+		rp->tex_layout,
 	};
 	const VkPipelineLayoutCreateInfo info = {
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-		.setLayoutCount = 1,
-		.pSetLayouts = &rp->desc_layout,
+		.setLayoutCount = ARRAY_LEN(set_layouts),
+		.pSetLayouts = set_layouts,
 		.pushConstantRangeCount = 1,
 		.pPushConstantRanges = &range,
 	};
@@ -189,6 +318,115 @@ create_pipeline_layout(struct vulkan *vk, struct vulkan_renderpass *rp)
 	return 0;
 }
 
+static int
+create_texture_set(struct vulkan *vk, struct vulkan_renderpass *rp)
+{
+	VkResult res;
+	const VkDescriptorPoolSize size = {
+		.type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+		.descriptorCount = vk->max_textures,
+	};
+	const VkDescriptorPoolCreateInfo pool_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+		.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+		.maxSets = 1,
+		.poolSizeCount = 1,
+		.pPoolSizes = &size,
+	};
+
+	res = vkCreateDescriptorPool(vk->logical_device, &pool_info,
+				     NULL, &rp->tex_pool);
+	if (res < 0) {
+		fprintf(stderr, "vkCreateDesciptorPool: 0x%x\n", res);
+		return -1;
+	}
+
+	const VkDescriptorSetAllocateInfo set_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+		.descriptorPool = rp->tex_pool,
+		.descriptorSetCount = 1,
+		.pSetLayouts = &rp->tex_layout,
+	};
+
+	res = vkAllocateDescriptorSets(vk->logical_device, &set_info,
+				       &rp->tex_set);
+	if (res < 0) {
+		fprintf(stderr, "vkAllocateDescriptorSets: 0x%x\n", res);
+		return -1;
+	}
+
+	rp->free_tex_slots = calloc(vk->max_textures,
+				    sizeof *rp->free_tex_slots);
+	if (!rp->free_tex_slots) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_init(&rp->tex_lock, NULL);
+
+	return 0;
+}
+
+int
+vulkan_renderpass_add_texture(struct vulkan *vk, struct vulkan_texture *t)
+{
+	struct vulkan_renderpass *rp = &vk->renderpass;
+	uint32_t slot;
+
+	pthread_mutex_lock(&rp->tex_lock);
+
+	if (rp->num_free_tex_slots > 0) {
+		slot = rp->free_tex_slots[--rp->num_free_tex_slots];
+	} else if (rp->next_tex_slot < vk->max_textures) {
+		slot = rp->next_tex_slot++;
+	} else {
+		pthread_mutex_unlock(&rp->tex_lock);
+		fprintf(stderr, "vulkan_renderpass_add_texture: "
+			"out of texture slots\n");
+		t->slot = -1;
+		return -1;
+	}
+
+	const VkDescriptorImageInfo image_info = {
+		.imageView = t->view,
+		.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+	};
+	const VkWriteDescriptorSet write = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = rp->tex_set,
+		.dstBinding = 0,
+		.dstArrayElement = slot,
+		.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+		.descriptorCount = 1,
+		.pImageInfo = &image_info,
+	};
+	vkUpdateDescriptorSets(vk->logical_device, 1, &write, 0, NULL);
+
+	pthread_mutex_unlock(&rp->tex_lock);
+
+	t->slot = slot;
+	return 0;
+}
+
+/*
+ * Only once nothing in flight can be drawing with it, since the slot may be
+ * handed out again straight away.
+ */
+void
+vulkan_renderpass_remove_texture(struct vulkan *vk, struct vulkan_texture *t)
+{
+	struct vulkan_renderpass *rp = &vk->renderpass;
+
+	if (t->slot < 0)
+		return;
+
+	pthread_mutex_lock(&rp->tex_lock);
+	rp->free_tex_slots[rp->num_free_tex_slots++] = t->slot;
+	pthread_mutex_unlock(&rp->tex_lock);
+
+	t->slot = -1;
+}
+
 static int
 compile_shaders(struct vulkan *vk,
 		VkShaderModule *vert, VkShaderModule *frag)
@@ -222,21 +460,40 @@ compile_shaders(struct vulkan *vk,
 	return 0;
 }
 
+/*
+ * shader.frag premultiplies views itself, so everything comes out
+ * premultiplied, the same as layer caches and what the compositor wants.
+ */
+static const VkPipelineColorBlendAttachmentState premult_blend = {
+	.blendEnable = VK_TRUE,
+	.srcColorBlendFactor = VK_BLEND_FACTOR_ONE,
+	.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+	.colorBlendOp = VK_BLEND_OP_ADD,
+	.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+	.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+	.alphaBlendOp = VK_BLEND_OP_ADD,
+	.colorWriteMask =
+		VK_COLOR_COMPONENT_R_BIT |
+		VK_COLOR_COMPONENT_G_BIT |
+		VK_COLOR_COMPONENT_B_BIT |
+		VK_COLOR_COMPONENT_A_BIT,
+};
+
 static int
 create_pipeline(struct vulkan *vk,
 		struct vulkan_renderpass *rp,
 		VkShaderModule *vert, VkShaderModule *frag)
 {
 	VkResult res;
-	static const VkSpecializationMapEntry max_tex = {
+	static const VkSpecializationMapEntry spec_entry = {
 		.constantID = 0,
 		.offset = 0,
-		.size = sizeof(vk->max_textures),
+		.size = sizeof(uint32_t),
 	};
 	const VkSpecializationInfo frag_spec = {
 		.mapEntryCount = 1,
-		.pMapEntries = &max_tex,
-		.dataSize = sizeof(vk->max_textures),
+		.pMapEntries = &spec_entry,
+		.dataSize = sizeof vk->max_textures,
 		.pData = &vk->max_textures,
 	};
 	const VkPipelineShaderStageCreateInfo shader_info[2] = {
@@ -255,23 +512,48 @@ create_pipeline(struct vulkan *vk,
 		},
 	};
 
+	/* The quad's corners come from gl_VertexIndex, so it's all instanced */
 	static const VkVertexInputBindingDescription vi_bind = {
 		.binding = 0,
-		.stride = sizeof(float[4]),
-		.inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+		.stride = sizeof(struct vulkan_instance),
+		.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
 	};
 	static const VkVertexInputAttributeDescription vi_attr[] = {
 		{
 			.binding = 0,
 			.location = 0,
 			.format = VK_FORMAT_R32G32_SFLOAT,
-			.offset = 0,
+			.offset = offsetof(struct vulkan_instance, quad.x),
 		},
 		{
 			.binding = 0,
 			.location = 1,
-			.format = VK_FORMAT_R32G32_SFLOAT,
-			.offset = sizeof(float[2]),
+			.format = VK_FORMAT_R32G32B32A32_SFLOAT,
+			.offset = offsetof(struct vulkan_instance, quad.across_x),
+		},
+		{
+			.binding = 0,
+			.location = 2,
+			.format = VK_FORMAT_R16G16B16A16_UNORM,
+			.offset = offsetof(struct vulkan_instance, uv),
+		},
+		{
+			.binding = 0,
+			.location = 3,
+			.format = VK_FORMAT_R32_UINT,
+			.offset = offsetof(struct vulkan_instance, transform),
+		},
+		{
+			.binding = 0,
+			.location = 4,
+			.format = VK_FORMAT_R16_UINT,
+			.offset = offsetof(struct vulkan_instance, tex_id),
+		},
+		{
+			.binding = 0,
+			.location = 5,
+			.format = VK_FORMAT_R16_UNORM,
+			.offset = offsetof(struct vulkan_instance, opacity),
 		},
 	};
 	static const VkPipelineVertexInputStateCreateInfo vi_info = {
@@ -315,26 +597,12 @@ create_pipeline(struct vulkan *vk,
 		.alphaToOneEnable = VK_FALSE,
 	};
 
-	static const VkPipelineColorBlendAttachmentState cb_attachment = {
-		.blendEnable = VK_TRUE,
-		.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
-		.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
-		.colorBlendOp = VK_BLEND_OP_ADD,
-		.srcAlphaBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
-		.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
-		.alphaBlendOp = VK_BLEND_OP_ADD,
-		.colorWriteMask =
-			VK_COLOR_COMPONENT_R_BIT |
-			VK_COLOR_COMPONENT_G_BIT |
-			VK_COLOR_COMPONENT_B_BIT |
-			VK_COLOR_COMPONENT_A_BIT,
-	};
-	static const VkPipelineColorBlendStateCreateInfo cb_info = {
+	const VkPipelineColorBlendStateCreateInfo cb_info = {
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
 		.logicOpEnable = VK_FALSE,
 		//.logicOp = VK_LOGIC_OP_CLEAR,
 		.attachmentCount = 1,
-		.pAttachments = &cb_attachment,
+		.pAttachments = &premult_blend,
 		//.blendConstants = { 1.0, 1.0, 1.0, 1.0 },
 	};
 
@@ -380,6 +648,71 @@ create_pipeline(struct vulkan *vk,
 	return 0;
 }
 
+static int
+create_cull_pipeline(struct vulkan *vk, struct vulkan_renderpass *rp)
+{
+	VkResult res;
+	VkShaderModule comp;
+	static const VkShaderModuleCreateInfo comp_info = {
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof cull_shader,
+		.pCode = cull_shader,
+	};
+
+	static const VkPushConstantRange range = {
+		.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		.offset = 0,
+		.size = sizeof(struct vulkan_cull_pass),
+	};
+	const VkPipelineLayoutCreateInfo layout_info = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+		.setLayoutCount = 1,
+		.pSetLayouts = &rp->desc_layout,
+		.pushConstantRangeCount = 1,
+		.pPushConstantRanges = &range,
+	};
+
+	res = vkCreatePipelineLayout(vk->logical_device,
+				     &layout_info, NULL,
+				     &rp->cull_layout);
+	if (res < 0) {
+		fprintf(stderr, "vkCreatePipelineLayout: 0x%x\n", res);
+		return -1;
+	}
+
+	res = vkCreateShaderModule(vk->logical_device, &comp_info, NULL, &comp);
+	if (res < 0) {
+		fprintf(stderr, "vkCreateShaderModule (comp): 0x%x\n",
+			res);
+		return -1;
+	}
+
+	const VkComputePipelineCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+		.stage = {
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_COMPUTE_BIT,
+			.module = comp,
+			.pName = "main",
+		},
+		.layout = rp->cull_layout,
+		.basePipelineHandle = VK_NULL_HANDLE,
+		.basePipelineIndex = -1,
+	};
+
+	res = vkCreateComputePipelines(vk->logical_device, NULL,
+				       1, &info,
+				       NULL, &rp->cull_pipeline);
+	vkDestroyShaderModule(vk->logical_device, comp, NULL);
+	if (res < 0) {
+		fprintf(stderr, "vkCreateComputePipelines: 0x%x\n",
+			res);
+		return -1;
+	}
+
+	return 0;
+}
+
 int
 vulkan_init_renderpass(struct vulkan *vk,
 		       struct vulkan_renderpass *rp)
@@ -389,12 +722,18 @@ vulkan_init_renderpass(struct vulkan *vk,
 	if (create_renderpass(vk, rp) < 0)
 		return -1;
 
+	if (create_cache_renderpass(vk, rp) < 0)
+		return -1;
+
 	if (create_sampler(vk, rp) < 0)
 		return -1;
 
 	if (create_pipeline_layout(vk, rp) < 0)
 		return -1;
 
+	if (create_texture_set(vk, rp) < 0)
+		return -1;
+
 	if (compile_shaders(vk, &vert, &frag) < 0)
 		return -1;
 
@@ -404,5 +743,8 @@ vulkan_init_renderpass(struct vulkan *vk,
 	vkDestroyShaderModule(vk->logical_device, vert, NULL);
 	vkDestroyShaderModule(vk->logical_device, frag, NULL);
 
+	if (create_cull_pipeline(vk, rp) < 0)
+		return -1;
+
 	return 0;
 }
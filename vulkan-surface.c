@@ -3,6 +3,7 @@
 #include "vulkan.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +19,9 @@
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
 
+/* Each frame in flight has its own descriptor set */
+#define MAX_FRAME_SETS 2
+
 static int
 create_image_view(struct vulkan *vk,
 		  struct vulkan_image *image)
@@ -88,19 +92,25 @@ create_descriptor_pool(struct vulkan *vk, struct vulkan_surface *surf)
 {
 	VkResult res;
 	const VkDescriptorPoolSize sizes[] = {
+		/* Immutable, but still allocated from the pool */
+		{
+			.type = VK_DESCRIPTOR_TYPE_SAMPLER,
+			.descriptorCount = MAX_FRAME_SETS,
+		},
 		{
 			.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-			.descriptorCount = 1,
+			.descriptorCount = MAX_FRAME_SETS,
 		},
+		/* The resident arrays, culled instances and draws */
 		{
-			.type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
-			.descriptorCount = vk->max_textures,
+			.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 5 * MAX_FRAME_SETS,
 		},
 	};
 
 	const VkDescriptorPoolCreateInfo info = {
 		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-		.maxSets = 2,
+		.maxSets = MAX_FRAME_SETS,
 		.poolSizeCount = ARRAY_LEN(sizes),
 		.pPoolSizes = sizes,
 	};
@@ -149,6 +159,7 @@ get_swapchain_images(struct vulkan *vk,
 			return -1;
 
 		img->undefined = true;
+		img->age = 0;
 	}
 
 	surf->num_images = num_images;
@@ -218,7 +229,9 @@ vulkan_surface_resize_swapchain(struct vulkan *vk,
 				struct vulkan_surface *surf,
 				uint32_t width, uint32_t height)
 {
+	pthread_mutex_lock(&vk->gfx_queue->lock);
 	vkQueueWaitIdle(vk->gfx_queue->queue);
+	pthread_mutex_unlock(&vk->gfx_queue->lock);
 
 	cleanup_old_swapchain(vk, surf);
 
@@ -255,10 +268,22 @@ vulkan_surface_prepare_frame(struct vulkan_surface *surf)
 	}
 
 	if (f) {
+		struct vulkan_texture *t, *tmp;
+
 		vkResetFences(vk->logical_device, 1, &f->fence);
 
-		vulkan_mm_free_buffer(vk, &f->uniform);
-		vulkan_mm_free_buffer(vk, &f->vertex);
+		vulkan_mm_ring_release(&surf->ring, f->ring_generation,
+				       f->ring_end);
+		if (f->retired_ring.buffer != VK_NULL_HANDLE)
+			vulkan_mm_free_buffer(vk, &f->retired_ring);
+		for (int i = 0; i < VULKAN_NUM_RESIDENT; ++i) {
+			if (f->retired_resident[i].buffer != VK_NULL_HANDLE)
+				vulkan_mm_free_buffer(vk,
+						      &f->retired_resident[i]);
+		}
+
+		wl_list_for_each_safe(t, tmp, &f->garbage, link)
+			vulkan_mm_free_texture(vk, t);
 
 		/* Reinsert at end of queue */
 		wl_list_remove(&f->link);
@@ -270,9 +295,11 @@ vulkan_surface_prepare_frame(struct vulkan_surface *surf)
 		if (!f)
 			return NULL;
 
+		wl_list_init(&f->garbage);
+
 		const VkCommandBufferAllocateInfo cmd_info = {
 			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-			.commandPool = vk->gfx_queue->command_pool,
+			.commandPool = surf->command_pool,
 			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
 			.commandBufferCount = 1,
 		};
@@ -317,51 +344,745 @@ vulkan_surface_prepare_frame(struct vulkan_surface *surf)
 	return f;
 }
 
+/* What we drew the layer into, if anything */
+static struct vulkan_texture *
+cache_texture(struct vulkan_surface *surf, uint32_t id)
+{
+	return id < surf->caches_cap ? surf->caches[id] : NULL;
+}
+
+static struct vulkan_texture *
+item_texture(struct vulkan_surface *surf,
+	     const struct scene_snapshot_item *item)
+{
+	return item->texture ? item->texture : cache_texture(surf, item->id);
+}
+
+static uint16_t
+to_unorm16(float value)
+{
+	if (!(value > 0.0f))
+		return 0;
+	if (value >= 1.0f)
+		return VULKAN_UNORM16_MAX;
+
+	return (uint16_t)lroundf(value * VULKAN_UNORM16_MAX);
+}
+
+/*
+ * Makes room for len entries, and makes sure there's a buffer to bind even
+ * if there aren't any. A bigger buffer starts out with what the old one
+ * had, which can only be freed once this frame is done with it, and zeroes
+ * after that, same as the copy.
+ */
+static int
+resident_reserve(struct vulkan_surface *surf, struct vulkan_frame *frame,
+		 enum vulkan_resident_type type, uint32_t len)
+{
+	struct vulkan_resident *r = &surf->resident[type];
+	struct vulkan_buffer b;
+	uint32_t cap = r->cap ? r->cap : 64;
+	void *data;
+	bool *pending;
+
+	if (r->cap > 0 && len <= r->cap)
+		return 0;
+
+	while (cap < len)
+		cap *= 2;
+
+	data = realloc(r->data, cap * r->stride);
+	if (!data)
+		return -1;
+	r->data = data;
+
+	pending = realloc(r->pending, cap * sizeof *pending);
+	if (!pending)
+		return -1;
+	r->pending = pending;
+
+	if (vulkan_mm_alloc_resident_buffer(surf->vk, &b, cap * r->stride) < 0)
+		return -1;
+
+	memset((char *)r->data + r->cap * r->stride, 0,
+	       (cap - r->cap) * r->stride);
+	memset(&r->pending[r->cap], 0, (cap - r->cap) * sizeof *r->pending);
+
+	/*
+	 * If it was replaced before, and that never got submitted, the one
+	 * in between never had anything in it.
+	 */
+	if (!r->replaced) {
+		r->old = r->buffer.buffer;
+		r->old_size = r->buffer.size;
+		r->replaced = true;
+	}
+
+	/* Earlier frames are still reading the old one */
+	assert(frame->retired_resident[type].buffer == VK_NULL_HANDLE);
+	frame->retired_resident[type] = r->buffer;
+
+	r->buffer = b;
+	r->cap = cap;
+
+	return 0;
+}
+
+/* Queues the entry to be copied over if it isn't what's there already */
+static int
+resident_write(struct vulkan_resident *r, uint32_t index, const void *entry)
+{
+	char *dst = (char *)r->data + index * r->stride;
+	uint64_t offset = index * r->stride;
+	VkBufferCopy *last = r->num_copies ?
+		&r->copies[r->num_copies - 1] : NULL;
+
+	if (memcmp(dst, entry, r->stride) == 0)
+		return 0;
+
+	memcpy(dst, entry, r->stride);
+
+	/* Whatever's in the copy at the time gets sent along */
+	if (r->pending[index])
+		return 0;
+
+	if (last && last->dstOffset + last->size == offset) {
+		last->size += r->stride;
+	} else {
+		if (r->num_copies == r->copies_cap) {
+			uint32_t cap = r->copies_cap ? r->copies_cap * 2 : 64;
+			VkBufferCopy *copies = realloc(r->copies,
+						       cap * sizeof *copies);
+			if (!copies)
+				return -1;
+
+			r->copies = copies;
+			r->copies_cap = cap;
+		}
+
+		/* Where it is in the ring depends on the frame */
+		r->copies[r->num_copies++] = (VkBufferCopy) {
+			.dstOffset = offset,
+			.size = r->stride,
+		};
+	}
+
+	r->pending[index] = true;
+	r->upload_size += r->stride;
+	return 0;
+}
+
+/* Once the copies have been submitted, they're done with */
+static void
+resident_submitted(struct vulkan_resident *r)
+{
+	for (uint32_t i = 0; i < r->num_copies; ++i) {
+		const VkBufferCopy *c = &r->copies[i];
+
+		memset(&r->pending[c->dstOffset / r->stride], 0,
+		       c->size / r->stride * sizeof *r->pending);
+	}
+
+	r->num_copies = 0;
+	r->upload_size = 0;
+	r->replaced = false;
+}
+
 struct update {
-	VkDescriptorImageInfo *info;
-	int32_t index;
+	const struct scene_snapshot *snap;
+	/* Entries in the slot list so far */
+	uint32_t num_slots;
 };
 
+/*
+ * Each item with a texture goes in the slot list, and its instance and
+ * transform get updated if they changed.
+ */
+static int
+write_items(struct vulkan_surface *surf, struct update *u,
+	    const struct scene_snapshot_item *items, uint32_t len)
+{
+	struct vulkan_resident *r = surf->resident;
+
+	for (uint32_t i = 0; i < len; ++i) {
+		const struct scene_snapshot_item *item = &items[i];
+		struct vulkan_texture *t = item_texture(surf, item);
+		uint32_t slot = item->slot;
+
+		if (!t)
+			continue;
+
+		uint16_t tex_id = t->slot;
+
+		/* Cached layers get drawn in place of their contents */
+		if (!item->texture)
+			tex_id |= VULKAN_INSTANCE_PREMULTIPLIED;
+
+		const struct vulkan_instance instance = {
+			.quad = u->snap->quads[slot],
+			.uv = { 0, 0, VULKAN_UNORM16_MAX, VULKAN_UNORM16_MAX },
+			.transform = item->transform,
+			.tex_id = tex_id,
+			.opacity = to_unorm16(item->opacity),
+		};
+
+		if (resident_write(&r[VULKAN_RESIDENT_INSTANCES], slot,
+				   &instance) < 0)
+			return -1;
+		if (resident_write(&r[VULKAN_RESIDENT_TRANSFORMS],
+				   item->transform,
+				   &u->snap->transforms[item->transform]) < 0)
+			return -1;
+		if (resident_write(&r[VULKAN_RESIDENT_SLOTS], u->num_slots++,
+				   &slot) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Lays out every resident array's changes in the ring, starting at offset */
+static void
+write_uploads(struct vulkan_surface *surf, uint64_t offset)
+{
+	char *stream = surf->ring.buffer.data;
+
+	for (int i = 0; i < VULKAN_NUM_RESIDENT; ++i) {
+		struct vulkan_resident *r = &surf->resident[i];
+
+		for (uint32_t j = 0; j < r->num_copies; ++j) {
+			VkBufferCopy *c = &r->copies[j];
+
+			c->srcOffset = offset;
+			memcpy(stream + offset, (char *)r->data + c->dstOffset,
+			       c->size);
+			offset += c->size;
+		}
+	}
+}
+
+/*
+ * Copies the changes over before anything reads them. Replaced buffers
+ * get their old contents first, and earlier frames might still be reading
+ * what gets overwritten.
+ */
+static void
+record_uploads(struct vulkan_surface *surf, struct vulkan_frame *frame)
+{
+	VkCommandBuffer cmd = frame->command_buffer;
+	bool replaced = false, changed = false;
+
+	for (int i = 0; i < VULKAN_NUM_RESIDENT; ++i) {
+		replaced |= surf->resident[i].replaced;
+		changed |= surf->resident[i].num_copies > 0;
+	}
+
+	if (!replaced && !changed)
+		return;
+
+	vkCmdPipelineBarrier(cmd,
+			     VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+			     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			     VK_PIPELINE_STAGE_TRANSFER_BIT,
+			     0,
+			     0, NULL,
+			     0, NULL,
+			     0, NULL);
+
+	for (int i = 0; replaced && i < VULKAN_NUM_RESIDENT; ++i) {
+		const struct vulkan_resident *r = &surf->resident[i];
+
+		if (!r->replaced)
+			continue;
+
+		if (r->old != VK_NULL_HANDLE) {
+			const VkBufferCopy copy = {
+				.size = r->old_size,
+			};
+			vkCmdCopyBuffer(cmd, r->old, r->buffer.buffer,
+					1, &copy);
+		}
+
+		vkCmdFillBuffer(cmd, r->buffer.buffer, r->old_size,
+				VK_WHOLE_SIZE, 0);
+	}
+
+	if (replaced) {
+		const VkMemoryBarrier barrier = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		};
+		vkCmdPipelineBarrier(cmd,
+				     VK_PIPELINE_STAGE_TRANSFER_BIT,
+				     VK_PIPELINE_STAGE_TRANSFER_BIT,
+				     0,
+				     1, &barrier,
+				     0, NULL,
+				     0, NULL);
+	}
+
+	for (int i = 0; i < VULKAN_NUM_RESIDENT; ++i) {
+		const struct vulkan_resident *r = &surf->resident[i];
+
+		if (r->num_copies > 0)
+			vkCmdCopyBuffer(cmd, surf->ring.buffer.buffer,
+					r->buffer.buffer,
+					r->num_copies, r->copies);
+	}
+
+	const VkMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+	};
+	vkCmdPipelineBarrier(cmd,
+			     VK_PIPELINE_STAGE_TRANSFER_BIT,
+			     VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+			     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			     0,
+			     1, &barrier,
+			     0, NULL,
+			     0, NULL);
+}
+
+/* Lays out len more bytes of a frame's data, returning where they start */
+static uint64_t
+stream_reserve(struct vulkan *vk, uint64_t *size, uint64_t len)
+{
+	uint64_t offset = (*size + vk->stream_align - 1) /
+		vk->stream_align * vk->stream_align;
+
+	*size = offset + len;
+	return offset;
+}
+
+/*
+ * Figures out which parts of the image need repainting: whatever changed in
+ * the scene now, plus whatever changed since the image was last presented.
+ */
+static void
+get_image_damage(struct vulkan_surface *surf, struct vulkan_image *img,
+		 const struct region *scene_damage, struct region *damage)
+{
+	region_init(damage);
+
+	if (img->age == 0 || img->age > VULKAN_DAMAGE_HISTORY + 1) {
+		region_add_rect(damage, 0, 0, surf->width, surf->height);
+		return;
+	}
+
+	region_union(damage, scene_damage);
+	for (uint32_t i = 0; i + 1 < img->age; ++i)
+		region_union(damage, &surf->damage[i]);
+
+	region_intersect_rect(damage, 0, 0, surf->width, surf->height);
+}
+
+/* Should be called after presenting the image */
 static void
-update_ds(struct scene_view *v, void *data)
+update_image_ages(struct vulkan_surface *surf, struct vulkan_image *img,
+		  const struct region *scene_damage)
 {
-	struct update *u = data;
+	for (uint32_t i = 0; i < surf->num_images; ++i) {
+		if (surf->images[i].age > 0)
+			++surf->images[i].age;
+	}
+	img->age = 1;
+
+	for (int i = VULKAN_DAMAGE_HISTORY - 1; i > 0; --i)
+		surf->damage[i] = surf->damage[i - 1];
+
+	surf->damage[0] = *scene_damage;
+}
 
-	u->info[u->index] = (VkDescriptorImageInfo) {
-		.imageView = v->texture->view,
-		.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+static uint32_t
+cull_groups(uint32_t count)
+{
+	return (count + VULKAN_CULL_GROUP_SIZE - 1) / VULKAN_CULL_GROUP_SIZE;
+}
+
+static int
+grow_passes(struct vulkan_surface *surf, uint32_t num)
+{
+	uint32_t cap = surf->passes_cap ? surf->passes_cap : 16;
+	struct vulkan_cull_pass *passes;
+
+	if (num <= surf->passes_cap)
+		return 0;
+
+	while (cap < num)
+		cap *= 2;
+
+	passes = realloc(surf->passes, cap * sizeof *passes);
+	if (!passes)
+		return -1;
+
+	surf->passes = passes;
+	surf->passes_cap = cap;
+
+	return 0;
+}
+
+/* Takes the slots from first up to num_slots */
+static void
+add_pass(struct vulkan_surface *surf, uint32_t *num_passes,
+	 uint32_t *num_commands, uint32_t first, uint32_t num_slots,
+	 const struct rect *clip, float opacity_scale)
+{
+	struct vulkan_cull_pass *pass = &surf->passes[(*num_passes)++];
+
+	*pass = (struct vulkan_cull_pass) {
+		.clip = {
+			clip->x,
+			clip->y,
+			clip->x + clip->width,
+			clip->y + clip->height,
+		},
+		.first = first,
+		.count = num_slots - first,
+		.command = *num_commands,
+		.opacity_scale = opacity_scale,
 	};
 
-	++u->index;
+	*num_commands += cull_groups(pass->count);
 }
 
-struct draw {
-	struct vulkan *vk;
-	struct vulkan_frame *frame;
-	int32_t index;
-};
+/*
+ * Culls every pass's instances against what it draws into, leaving the
+ * survivors and their draws in the ring for the render passes after.
+ */
+static void
+record_cull(struct vulkan_surface *surf, struct vulkan_frame *frame,
+	    uint32_t num_passes)
+{
+	struct vulkan *vk = surf->vk;
+
+	vkCmdBindPipeline(frame->command_buffer,
+			  VK_PIPELINE_BIND_POINT_COMPUTE,
+			  vk->renderpass.cull_pipeline);
+	vkCmdBindDescriptorSets(frame->command_buffer,
+				VK_PIPELINE_BIND_POINT_COMPUTE,
+				vk->renderpass.cull_layout, 0,
+				1, &frame->desc,
+				0, NULL);
 
+	for (uint32_t i = 0; i < num_passes; ++i) {
+		const struct vulkan_cull_pass *pass = &surf->passes[i];
+
+		if (pass->count == 0)
+			continue;
+
+		vkCmdPushConstants(frame->command_buffer,
+				   vk->renderpass.cull_layout,
+				   VK_SHADER_STAGE_COMPUTE_BIT, 0,
+				   sizeof *pass, pass);
+		vkCmdDispatch(frame->command_buffer,
+			      cull_groups(pass->count), 1, 1);
+	}
+
+	const VkMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+			VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
+	};
+	vkCmdPipelineBarrier(frame->command_buffer,
+			     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			     VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+			     VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+			     0,
+			     1, &barrier,
+			     0, NULL,
+			     0, NULL);
+}
+
+/*
+ * A draw for each group cull.comp ran, each covering whatever survived in
+ * it. Groups are in order, and so is what survives inside them, so
+ * painter's order is kept.
+ */
 static void
-draw_view(struct scene_view *v, void *data)
+draw_pass(struct vulkan_surface *surf, struct vulkan_frame *frame,
+	  const struct vulkan_cull_pass *pass)
 {
-	struct draw *d = data;
-	struct vulkan *vk = d->vk;
-	struct vulkan_frame *frame = d->frame;
-	int32_t index = d->index;
+	if (pass->count == 0)
+		return;
+
+	vkCmdDrawIndirect(frame->command_buffer, surf->ring.buffer.buffer,
+			  frame->commands_offset +
+			  pass->command * sizeof(VkDrawIndirectCommand),
+			  cull_groups(pass->count),
+			  sizeof(VkDrawIndirectCommand));
+}
+
+/* The scene gets moved by translate, then scaled, before it's projected */
+static void
+bind_common(struct vulkan_surface *surf, struct vulkan_frame *frame,
+	    float translate_x, float translate_y, float scale_x, float scale_y)
+{
+	struct vulkan *vk = surf->vk;
+	const float push[4] = { translate_x, translate_y, scale_x, scale_y };
+
+	/* What cull.comp kept; the instances it read are only its input */
+	vkCmdBindVertexBuffers(frame->command_buffer, 0, 1,
+			       &surf->ring.buffer.buffer,
+			       &frame->culled_offset);
+
+	const VkDescriptorSet sets[] = { frame->desc, vk->renderpass.tex_set };
+	vkCmdBindDescriptorSets(frame->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				vk->renderpass.pipeline_layout, 0,
+				ARRAY_LEN(sets), sets,
+				0, NULL);
 
 	vkCmdPushConstants(frame->command_buffer, vk->renderpass.pipeline_layout,
-			   VK_SHADER_STAGE_FRAGMENT_BIT, 0,
-			   sizeof index, &index);
+			   VK_SHADER_STAGE_VERTEX_BIT, 0,
+			   sizeof push, push);
+}
+
+/*
+ * Draws everything inside the layer into its cache. The quads are in
+ * scene space, so they get moved over to the cache's origin, then scaled
+ * so the surface's projection puts the whole layer over the texture. That's
+ * 1:1 unless the texture had to be smaller than the layer.
+ */
+static void
+record_cache(struct vulkan_surface *surf, struct vulkan_frame *frame,
+	     const struct scene_snapshot_cache *cache,
+	     const struct vulkan_cull_pass *pass)
+{
+	struct vulkan *vk = surf->vk;
+	const struct rect *box = &cache->bounds;
+	struct vulkan_texture *t = surf->caches[cache->id];
 
-	vkCmdDraw(frame->command_buffer, 6, 1, index * 6, 0);
+	const VkClearValue clear = {
+		.color.float32 = { 0.0f, 0.0f, 0.0f, 0.0f },
+	};
+	const VkRect2D area = {
+		.extent.width = t->width,
+		.extent.height = t->height,
+	};
+	const VkRenderPassBeginInfo rp_info = {
+		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+		.renderPass = vk->renderpass.cache_renderpass,
+		.framebuffer = t->framebuffer,
+		.renderArea = area,
+		.clearValueCount = 1,
+		.pClearValues = &clear,
+	};
 
-	printf("Drawing index %d\n", index);
+	vkCmdBeginRenderPass(frame->command_buffer, &rp_info,
+			     VK_SUBPASS_CONTENTS_INLINE);
 
-	++d->index;
+	const VkViewport viewport = {
+		.x = 0,
+		.y = 0,
+		.width = t->width,
+		.height = t->height,
+		.minDepth = 0.0f,
+		.maxDepth = 1.0f,
+	};
+	vkCmdSetViewport(frame->command_buffer, 0, 1, &viewport);
+	vkCmdSetScissor(frame->command_buffer, 0, 1, &area);
+
+	vkCmdBindPipeline(frame->command_buffer,
+			  VK_PIPELINE_BIND_POINT_GRAPHICS, vk->renderpass.pipeline);
+	bind_common(surf, frame, -box->x, -box->y,
+		    (float)surf->width / box->width,
+		    (float)surf->height / box->height);
+
+	draw_pass(surf, frame, pass);
+
+	vkCmdEndRenderPass(frame->command_buffer);
+}
+
+static void
+record_draw(struct vulkan_surface *surf, struct vulkan_frame *frame,
+	    struct vulkan_image *img, const struct vulkan_cull_pass *pass,
+	    const VkRect2D *scissor)
+{
+	struct vulkan *vk = surf->vk;
+
+	const VkRenderPassBeginInfo rp_info = {
+		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+		.renderPass = vk->renderpass.renderpass,
+		.framebuffer = img->framebuffer,
+		.renderArea = *scissor,
+		.clearValueCount = 0,
+		.pClearValues = NULL,
+	};
+
+	vkCmdBeginRenderPass(frame->command_buffer, &rp_info,
+			     VK_SUBPASS_CONTENTS_INLINE);
+
+	const VkViewport viewport = {
+		.x = 0,
+		.y = 0,
+		.width = surf->width,
+		.height = surf->height,
+		.minDepth = 0.0f,
+		.maxDepth = 1.0f,
+	};
+	vkCmdSetViewport(frame->command_buffer, 0, 1, &viewport);
+
+	vkCmdSetScissor(frame->command_buffer, 0, 1, scissor);
+
+	static const VkClearAttachment clear = {
+		.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+		.colorAttachment = 0,
+		.clearValue.color.float32 = { 0.8f, 0.8f, 0.8f, 0.8f },
+	};
+	const VkClearRect clear_rect = {
+		.rect = *scissor,
+		.baseArrayLayer = 0,
+		.layerCount = 1,
+	};
+	vkCmdClearAttachments(frame->command_buffer,
+			      1, &clear, 1, &clear_rect);
+
+	vkCmdBindPipeline(frame->command_buffer,
+			  VK_PIPELINE_BIND_POINT_GRAPHICS, vk->renderpass.pipeline);
+	bind_common(surf, frame, 0.0f, 0.0f, 1.0f, 1.0f);
+
+	draw_pass(surf, frame, pass);
+
+	vkCmdEndRenderPass(frame->command_buffer);
+}
+
+static struct vulkan_texture *
+create_cache_texture(struct vulkan *vk, int width, int height)
+{
+	VkResult res;
+	struct vulkan_texture *t;
+	static const VkComponentMapping mapping = {
+		.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+		.g = VK_COMPONENT_SWIZZLE_IDENTITY,
+		.b = VK_COMPONENT_SWIZZLE_IDENTITY,
+		.a = VK_COMPONENT_SWIZZLE_IDENTITY,
+	};
+
+	t = vulkan_mm_alloc_texture(vk, VK_FORMAT_B8G8R8A8_UNORM,
+				    width, height, &mapping,
+				    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+				    VK_IMAGE_USAGE_SAMPLED_BIT);
+	if (!t)
+		return NULL;
+
+	const VkFramebufferCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+		.renderPass = vk->renderpass.cache_renderpass,
+		.attachmentCount = 1,
+		.pAttachments = &t->view,
+		.width = width,
+		.height = height,
+		.layers = 1,
+	};
+
+	res = vkCreateFramebuffer(vk->logical_device, &info, NULL,
+				  &t->framebuffer);
+	if (res < 0) {
+		fprintf(stderr, "vkCreateFramebuffer: 0x%x\n", res);
+		vulkan_mm_free_texture(vk, t);
+		return NULL;
+	}
+
+	return t;
+}
+
+static int
+grow_caches(struct vulkan_surface *surf, uint32_t id)
+{
+	uint32_t cap = surf->caches_cap ? surf->caches_cap : 64;
+	struct vulkan_texture **caches;
+
+	while (cap <= id)
+		cap *= 2;
+
+	caches = realloc(surf->caches, cap * sizeof *caches);
+	if (!caches)
+		return -1;
+
+	memset(&caches[surf->caches_cap], 0,
+	       (cap - surf->caches_cap) * sizeof *caches);
+	surf->caches = caches;
+	surf->caches_cap = cap;
+
+	return 0;
+}
+
+/*
+ * The device can only make textures so big, so bigger layers get cached at
+ * a lower resolution. The cache is still drawn over the layer's bounds.
+ */
+static void
+cache_size(struct vulkan *vk, const struct rect *bounds,
+	   int *width, int *height)
+{
+	int max = vk->max_cache_size;
+
+	*width = bounds->width < max ? bounds->width : max;
+	*height = bounds->height < max ? bounds->height : max;
+}
+
+/*
+ * Frees the caches the scene no longer wants, and makes sure the ones to
+ * be redrawn have a texture of the right size. Old textures go on the
+ * frame's garbage list, since earlier frames might still be using them.
+ */
+static void
+prepare_caches(struct vulkan_surface *surf, struct vulkan_frame *frame,
+	       const struct scene_snapshot *snap)
+{
+	for (uint32_t i = 0; i < snap->num_dropped; ++i) {
+		uint32_t id = snap->dropped[i];
+
+		if (!cache_texture(surf, id))
+			continue;
+
+		wl_list_insert(&frame->garbage, &surf->caches[id]->link);
+		surf->caches[id] = NULL;
+	}
+
+	for (uint32_t i = 0; i < snap->num_redraw; ++i) {
+		const struct scene_snapshot_cache *c = &snap->redraw[i];
+		struct vulkan_texture *t;
+		int width, height;
+
+		if (c->id >= surf->caches_cap && grow_caches(surf, c->id) < 0)
+			continue;
+
+		cache_size(surf->vk, &c->bounds, &width, &height);
+
+		/* Reuse the old texture if the layer didn't change size */
+		t = surf->caches[c->id];
+		if (t && t->width == width && t->height == height)
+			continue;
+
+		if (t)
+			wl_list_insert(&frame->garbage, &t->link);
+
+		surf->caches[c->id] = create_cache_texture(surf->vk,
+							   width, height);
+		if (!surf->caches[c->id])
+			fprintf(stderr, "Failed to create a %dx%d cache for "
+				"layer %u\n", width, height, c->id);
+	}
+}
+
+bool
+vulkan_surface_needs_repaint(struct vulkan_surface *surf,
+			     const struct scene_snapshot *snap)
+{
+	/* Also covers the very first frame */
+	if (surf->needs_realloc)
+		return true;
+
+	return surf->generation != snap->generation;
 }
 
 int
-vulkan_surface_repaint(struct vulkan_surface *surf, struct scene *scene)
+vulkan_surface_repaint(struct vulkan_surface *surf,
+		       const struct scene_snapshot *snap)
 {
 	struct vulkan *vk = surf->vk;
 	VkResult res;
@@ -386,6 +1107,8 @@ vulkan_surface_repaint(struct vulkan_surface *surf, struct scene *scene)
 	if (res < 0) {
 		fprintf(stderr, "vkAcquireNextImage2KHR: 0x%x\n",
 			res);
+		if (res == VK_ERROR_OUT_OF_DATE_KHR)
+			surf->needs_realloc = true;
 		return 1;
 	}
 	if (res == VK_SUBOPTIMAL_KHR)
@@ -393,35 +1116,145 @@ vulkan_surface_repaint(struct vulkan_surface *surf, struct scene *scene)
 
 	img = &surf->images[i];
 	frame = vulkan_surface_prepare_frame(surf);
-	struct draw draw = {
-		.vk = vk,
-		.frame = frame,
-		.index = 0,
-	};
 
-	static const float mat[3][4] = {
-		{ 2.0f / 200.0f, 0.0f, 0.0f, NAN },
-		{ 0.0f, 2.0f / 200.0f, 0.0f, NAN },
+	prepare_caches(surf, frame, snap);
+
+	/* Already accounted for if we've drawn this snapshot before */
+	struct region scene_damage;
+	region_init(&scene_damage);
+	if (snap->generation != surf->generation)
+		region_union(&scene_damage, &snap->damage);
+
+	struct region damage;
+	struct rect extents;
+	get_image_damage(surf, img, &scene_damage, &damage);
+	region_extents(&damage, &extents);
+
+	/* Scene coordinates are buffer pixels */
+	const float mat[3][4] = {
+		{ 2.0f / surf->width, 0.0f, 0.0f, NAN },
+		{ 0.0f, 2.0f / surf->height, 0.0f, NAN },
 		{ -1.0f, -1.0f, 1.0f, NAN },
 	};
-	vulkan_mm_alloc_uniform_buffer(vk, &frame->uniform, sizeof mat);
-	memcpy(frame->uniform.mem->data, mat, sizeof mat);
+	static_assert(sizeof(struct transform) == sizeof(float[6]),
+		      "shader.vert expects packed transforms");
+
+	/* Only the last group of each pass can be partly empty */
+	if (grow_passes(surf, snap->num_redraw + 1) < 0)
+		return -1;
+
+	/* Items are either visible or inside a cache being redrawn */
+	if (resident_reserve(surf, frame, VULKAN_RESIDENT_TRANSFORMS,
+			     snap->num_transforms) < 0 ||
+	    resident_reserve(surf, frame, VULKAN_RESIDENT_INSTANCES,
+			     snap->num_quads) < 0 ||
+	    resident_reserve(surf, frame, VULKAN_RESIDENT_SLOTS,
+			     snap->num_items) < 0)
+		return -1;
+
+	/*
+	 * Everything that's drawn directly, followed by the contents of
+	 * whichever layer caches need to be redrawn. Moving a layer only
+	 * changes its transform, and those of the layers inside it, so that's
+	 * all that gets uploaded.
+	 */
+	struct update update = {
+		.snap = snap,
+	};
+	uint32_t num_passes = 0;
+	uint32_t num_commands = 0;
 
-	size_t vert_len = scene_get_vertex_size(scene);
-	vulkan_mm_alloc_vertex_buffer(vk, &frame->vertex, vert_len * sizeof(float));
-	scene_get_vertex_data(scene, frame->vertex.mem->data);
+	if (write_items(surf, &update, snap->items, snap->num_visible) < 0)
+		return -1;
+	/* Nothing needs drawing if nothing's damaged */
+	add_pass(surf, &num_passes, &num_commands, 0,
+		 region_is_empty(&damage) ? 0 : update.num_slots,
+		 &extents, 1.0f);
 
-	size_t num_textures = scene_get_num_nodes(scene);
+	for (uint32_t j = 0; j < snap->num_redraw; ++j) {
+		const struct scene_snapshot_cache *c = &snap->redraw[j];
+		uint32_t first = update.num_slots;
 
-	struct update update = { 0 };
-	update.info = calloc(num_textures, sizeof *update.info);
-	scene_for_each(scene, update_ds, &update);
+		if (!cache_texture(surf, c->id))
+			continue;
+
+		if (write_items(surf, &update, &snap->items[c->first],
+				c->len) < 0)
+			return -1;
+
+		/*
+		 * The layer's own opacity gets applied when the cache is
+		 * drawn. It can't be 0, since it wouldn't be visible then.
+		 */
+		add_pass(surf, &num_passes, &num_commands, first,
+			 update.num_slots, &c->bounds, 1.0f / c->opacity);
+	}
+
+	uint64_t upload_size = 0;
+	for (int j = 0; j < VULKAN_NUM_RESIDENT; ++j)
+		upload_size += surf->resident[j].upload_size;
+
+	uint32_t max_instances = update.num_slots ? update.num_slots : 1;
+	size_t culled_size = max_instances * sizeof(struct vulkan_instance);
+	size_t commands_size = num_commands ?
+		num_commands * sizeof(VkDrawIndirectCommand) :
+		sizeof(VkDrawIndirectCommand);
+
+	/* All of the frame's data goes in one piece of the ring */
+	uint64_t frame_size = 0;
+	frame->uniform_offset = stream_reserve(vk, &frame_size, sizeof mat);
+	frame->upload_offset = stream_reserve(vk, &frame_size, upload_size);
+	frame->culled_offset = stream_reserve(vk, &frame_size, culled_size);
+	frame->commands_offset = stream_reserve(vk, &frame_size,
+						commands_size);
+
+	uint64_t base;
+	if (vulkan_mm_ring_alloc(vk, &surf->ring, frame_size, &base,
+				 &frame->retired_ring) < 0)
+		return -1;
+	frame->ring_end = surf->ring.head;
+	frame->ring_generation = surf->ring.generation;
+	frame->uniform_offset += base;
+	frame->upload_offset += base;
+	frame->culled_offset += base;
+	frame->commands_offset += base;
+
+	char *stream = surf->ring.buffer.data;
+	memcpy(stream + frame->uniform_offset, mat, sizeof mat);
+	write_uploads(surf, frame->upload_offset);
 
 	const VkDescriptorBufferInfo buf_info = {
-		.buffer = frame->uniform.buffer,
-		.offset = 0,
+		.buffer = surf->ring.buffer.buffer,
+		.offset = frame->uniform_offset,
 		.range = sizeof mat,
 	};
+	const struct vulkan_resident *r = surf->resident;
+	const VkDescriptorBufferInfo resident_info[] = {
+		{
+			.buffer = r[VULKAN_RESIDENT_TRANSFORMS].buffer.buffer,
+			.range = VK_WHOLE_SIZE,
+		},
+		{
+			.buffer = r[VULKAN_RESIDENT_INSTANCES].buffer.buffer,
+			.range = VK_WHOLE_SIZE,
+		},
+		{
+			.buffer = r[VULKAN_RESIDENT_SLOTS].buffer.buffer,
+			.range = VK_WHOLE_SIZE,
+		},
+	};
+	const VkDescriptorBufferInfo cull_info[] = {
+		{
+			.buffer = surf->ring.buffer.buffer,
+			.offset = frame->culled_offset,
+			.range = culled_size,
+		},
+		{
+			.buffer = surf->ring.buffer.buffer,
+			.offset = frame->commands_offset,
+			.range = commands_size,
+		},
+	};
 	const VkWriteDescriptorSet ds_writes[] = {
 		{
 			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
@@ -435,16 +1268,52 @@ vulkan_surface_repaint(struct vulkan_surface *surf, struct scene *scene)
 		{
 			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
 			.dstSet = frame->desc,
-			.dstBinding = 2,
+			.dstBinding = 3,
+			.dstArrayElement = 0,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.pBufferInfo = &resident_info[0],
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = frame->desc,
+			.dstBinding = 4,
+			.dstArrayElement = 0,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.pBufferInfo = &resident_info[1],
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = frame->desc,
+			.dstBinding = 5,
 			.dstArrayElement = 0,
-			.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
-			.descriptorCount = num_textures,
-			.pImageInfo = update.info,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.pBufferInfo = &cull_info[0],
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = frame->desc,
+			.dstBinding = 6,
+			.dstArrayElement = 0,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.pBufferInfo = &cull_info[1],
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = frame->desc,
+			.dstBinding = 7,
+			.dstArrayElement = 0,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.pBufferInfo = &resident_info[2],
 		},
 	};
-	vkUpdateDescriptorSets(vk->logical_device,
-			       ARRAY_LEN(ds_writes), ds_writes,
-			       0, NULL);
+	/* Textures are already in the renderpass's texture set */
+	vkUpdateDescriptorSets(vk->logical_device, ARRAY_LEN(ds_writes),
+			       ds_writes, 0, NULL);
 
 	static const VkCommandBufferBeginInfo begin = {
 		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
@@ -491,68 +1360,31 @@ vulkan_surface_repaint(struct vulkan_surface *surf, struct scene *scene)
 		img->undefined = false;
 	}
 
-	const VkRenderPassBeginInfo rp_info = {
-		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-		.renderPass = vk->renderpass.renderpass,
-		.framebuffer = img->framebuffer,
-		.renderArea.offset.x = 0,
-		.renderArea.offset.y = 0,
-		.renderArea.extent.width = surf->width,
-		.renderArea.extent.height = surf->height,
-		.clearValueCount = 0,
-		.pClearValues = NULL,
-	};
+	record_uploads(surf, frame);
+	record_cull(surf, frame, num_passes);
 
-	vkCmdBeginRenderPass(frame->command_buffer, &rp_info,
-			     VK_SUBPASS_CONTENTS_INLINE);
+	/* Caches with a pass, in the same order they were added */
+	uint32_t pass = 1;
+	for (uint32_t j = 0; j < snap->num_redraw; ++j) {
+		const struct scene_snapshot_cache *c = &snap->redraw[j];
 
-	const VkViewport viewport = {
-		.x = 0,
-		.y = 0,
-		.width = surf->width,
-		.height = surf->height,
-		.minDepth = 0.0f,
-		.maxDepth = 1.0f,
-	};
-	vkCmdSetViewport(frame->command_buffer, 0, 1, &viewport);
+		if (cache_texture(surf, c->id))
+			record_cache(surf, frame, c, &surf->passes[pass++]);
+	}
 
 	const VkRect2D scissor = {
-		.offset.x = 0,
-		.offset.y = 0,
-		.extent.width = surf->width,
-		.extent.height = surf->height,
+		.offset.x = extents.x,
+		.offset.y = extents.y,
+		.extent.width = extents.width,
+		.extent.height = extents.height,
 	};
-	vkCmdSetScissor(frame->command_buffer, 0, 1, &scissor);
-
-	static const VkClearAttachment clear = {
-		.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-		.colorAttachment = 0,
-		.clearValue.color.float32 = { 0.8f, 0.8f, 0.8f, 0.8f },
-	};
-	const VkClearRect clear_rect = {
-		.rect = scissor,
-		.baseArrayLayer = 0,
-		.layerCount = 1,
-	};
-	vkCmdClearAttachments(frame->command_buffer,
-			      1, &clear, 1, &clear_rect);
-
-	vkCmdBindPipeline(frame->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			  vk->renderpass.pipeline);
 
-	static const VkDeviceSize offset = 0;
-	vkCmdBindVertexBuffers(frame->command_buffer, 0, 1,
-			       &frame->vertex.buffer, &offset);
-
-	vkCmdBindDescriptorSets(frame->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-				vk->renderpass.pipeline_layout, 0,
-				1, &frame->desc,
-				0, NULL);
-
-	draw.index = 0;
-	scene_for_each(scene, draw_view, &draw);
-
-	vkCmdEndRenderPass(frame->command_buffer);
+	/*
+	 * Our render pass loads the previous contents, so we only need to
+	 * touch the damaged area.
+	 */
+	if (!region_is_empty(&damage))
+		record_draw(surf, frame, img, &surf->passes[0], &scissor);
 
 	res = vkEndCommandBuffer(frame->command_buffer);
 	if (res < 0) {
@@ -573,15 +1405,44 @@ vulkan_surface_repaint(struct vulkan_surface *surf, struct scene *scene)
 		.pSignalSemaphores = &surf->done,
 	};
 
+	pthread_mutex_lock(&vk->gfx_queue->lock);
 	res = vkQueueSubmit(vk->gfx_queue->queue, 1, &submit_info,
 			    frame->fence);
+	pthread_mutex_unlock(&vk->gfx_queue->lock);
 	if (res < 0) {
 		fprintf(stderr, "vkQueueSubmit: 0x%x\n", res);
 		return -1;
 	}
 
+	for (int j = 0; j < VULKAN_NUM_RESIDENT; ++j)
+		resident_submitted(&surf->resident[j]);
+
+	/* Tell the compositor which parts actually changed */
+	VkRectLayerKHR rects[REGION_MAX_RECTS];
+	for (int j = 0; j < damage.num_rects; ++j) {
+		rects[j] = (VkRectLayerKHR) {
+			.offset.x = damage.rects[j].x,
+			.offset.y = damage.rects[j].y,
+			.extent.width = damage.rects[j].width,
+			.extent.height = damage.rects[j].height,
+			.layer = 0,
+		};
+	}
+	const VkPresentRegionKHR present_region = {
+		.rectangleCount = damage.num_rects,
+		.pRectangles = rects,
+	};
+	const VkPresentRegionsKHR present_regions = {
+		.sType = VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR,
+		.swapchainCount = 1,
+		.pRegions = &present_region,
+	};
+	bool use_regions = vk->incremental_present &&
+		!region_is_empty(&damage);
+
 	const VkPresentInfoKHR present_info = {
 		.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+		.pNext = use_regions ? &present_regions : NULL,
 		.waitSemaphoreCount = 1,
 		.pWaitSemaphores = &surf->done,
 		.swapchainCount = 1,
@@ -590,12 +1451,20 @@ vulkan_surface_repaint(struct vulkan_surface *surf, struct scene *scene)
 		.pResults = NULL,
 	};
 
+	/* Presenting attaches and commits on the Wayland surface */
+	pthread_mutex_lock(&surf->wl_surf->lock);
+	pthread_mutex_lock(&vk->gfx_queue->lock);
 	res = vkQueuePresentKHR(vk->gfx_queue->queue, &present_info);
+	pthread_mutex_unlock(&vk->gfx_queue->lock);
+	pthread_mutex_unlock(&surf->wl_surf->lock);
 	if (res < 0) {
 		fprintf(stderr, "vkQueuePresentKHR: 0x%x\n", res);
 		return -1;
 	}
 
+	update_image_ages(surf, img, &scene_damage);
+	surf->generation = snap->generation;
+
 	return 0;
 }
 
@@ -671,9 +1540,29 @@ vulkan_surface_init(struct vulkan_surface *surf,
 	if (create_descriptor_pool(vk, surf) < 0)
 		return -1;
 
+	const VkCommandPoolCreateInfo pool_info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+		.queueFamilyIndex = vk->gfx_queue->index,
+	};
+
+	res = vkCreateCommandPool(vk->logical_device, &pool_info, NULL,
+				  &surf->command_pool);
+	if (res < 0) {
+		fprintf(stderr, "vkCreateCommandPool: 0x%x\n", res);
+		return -1;
+	}
+
 	surf->vk = vk;
+	surf->wl_surf = wl_surf;
 	surf->needs_realloc = true;
 	wl_list_init(&surf->frame_res);
 
+	surf->resident[VULKAN_RESIDENT_TRANSFORMS].stride =
+		sizeof(struct transform);
+	surf->resident[VULKAN_RESIDENT_INSTANCES].stride =
+		sizeof(struct vulkan_instance);
+	surf->resident[VULKAN_RESIDENT_SLOTS].stride = sizeof(uint32_t);
+
 	return 0;
 }
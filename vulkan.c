@@ -38,6 +38,7 @@ create_queue(struct vulkan *vk, uint32_t index)
 	}
 
 	q->index = index;
+	pthread_mutex_init(&q->lock, NULL);
 	return q;
 
 fail:
@@ -45,14 +46,32 @@ fail:
 	return NULL;
 }
 
+static bool
+has_device_extension(VkPhysicalDevice phy, const char *name)
+{
+	uint32_t num_exts;
+	vkEnumerateDeviceExtensionProperties(phy, NULL, &num_exts, NULL);
+
+	VkExtensionProperties exts[num_exts];
+	vkEnumerateDeviceExtensionProperties(phy, NULL, &num_exts, exts);
+
+	for (uint32_t i = 0; i < num_exts; ++i) {
+		if (strcmp(exts[i].extensionName, name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
 static int
 create_logical_device(struct vulkan *vk, uint32_t gfx, uint32_t xfer)
 {
 	VkResult res;
 	/* TODO: check for these properly */
-	static const char *exts[] = {
+	const char *exts[2] = {
 		"VK_KHR_swapchain",
 	};
+	uint32_t num_exts = 1;
 	static const float queue_pri = 0.0;
 
 	const VkDeviceQueueCreateInfo queues[2] = {
@@ -71,9 +90,20 @@ create_logical_device(struct vulkan *vk, uint32_t gfx, uint32_t xfer)
 	};
 	uint32_t num_queues = gfx == xfer ? 1 : 2;
 
+	/* Optional; lets us tell the compositor what we actually changed */
+	if (has_device_extension(vk->physical_device,
+				 "VK_KHR_incremental_present")) {
+		exts[num_exts++] = "VK_KHR_incremental_present";
+		vk->incremental_present = true;
+	}
+
 	VkPhysicalDeviceVulkan12Features vk12_f = {
 		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
 		.descriptorBindingPartiallyBound = VK_TRUE,
+		/* Textures get written into the array while it's in use */
+		.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE,
+		/* A draw covers many textures, so the index varies within it */
+		.shaderSampledImageArrayNonUniformIndexing = VK_TRUE,
 	};
 	VkPhysicalDeviceFeatures2 f = {
 		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
@@ -84,13 +114,16 @@ create_logical_device(struct vulkan *vk, uint32_t gfx, uint32_t xfer)
 		 * Vulkan implementations.
 		 */
 		.features.shaderSampledImageArrayDynamicIndexing = VK_TRUE,
+		/* cull.comp writes a draw per group, each from its own place */
+		.features.multiDrawIndirect = VK_TRUE,
+		.features.drawIndirectFirstInstance = VK_TRUE,
 	};
 	const VkDeviceCreateInfo info = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
 		.pNext = &f,
 		.queueCreateInfoCount = num_queues,
 		.pQueueCreateInfos = queues,
-		.enabledExtensionCount = ARRAY_LEN(exts),
+		.enabledExtensionCount = num_exts,
 		.ppEnabledExtensionNames = exts,
 		.pEnabledFeatures = NULL,
 	};
@@ -173,7 +206,14 @@ select_physical_device(struct vulkan *vk, struct wl_display *wl,
 	vkEnumeratePhysicalDevices(vk->instance, &num_phy, phy);
 
 	for (uint32_t i = 0; i < num_phy; ++i) {
-		VkPhysicalDeviceProperties props;
+		VkPhysicalDeviceVulkan12Properties vk12_props = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES,
+		};
+		VkPhysicalDeviceProperties2 props2 = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+			.pNext = &vk12_props,
+		};
+		const VkPhysicalDeviceProperties *props = &props2.properties;
 		VkPhysicalDeviceVulkan12Features vk12_f = {
 			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
 		};
@@ -182,29 +222,51 @@ select_physical_device(struct vulkan *vk, struct wl_display *wl,
 			.pNext = &vk12_f,
 		};
 
-		vkGetPhysicalDeviceProperties(phy[i], &props);
-		vkGetPhysicalDeviceFeatures2(phy[i], &f);
-
-		if (props.apiVersion < VK_API_VERSION_1_2)
+		/* Only has Vulkan 1.2 properties if it supports 1.2 */
+		vkGetPhysicalDeviceProperties(phy[i], &props2.properties);
+		if (props->apiVersion < VK_API_VERSION_1_2)
 			continue;
 
+		vkGetPhysicalDeviceProperties2(phy[i], &props2);
+		vkGetPhysicalDeviceFeatures2(phy[i], &f);
+
 		if (!f.features.shaderSampledImageArrayDynamicIndexing)
 			continue;
+		if (!f.features.multiDrawIndirect ||
+		    !f.features.drawIndirectFirstInstance)
+			continue;
 		if (!vk12_f.descriptorBindingPartiallyBound)
 			continue;
+		if (!vk12_f.descriptorBindingSampledImageUpdateAfterBind)
+			continue;
+		if (!vk12_f.shaderSampledImageArrayNonUniformIndexing)
+			continue;
 
 		if (physical_device_find_queues(phy[i], wl, gfx, xfer) < 0)
 			continue;
 
 		vk->physical_device = phy[i];
-		vk->max_textures = props.limits.maxPerStageDescriptorSampledImages;
-
-		/*
-		 * Lets keep it somewhat sensible, but still significantly
-		 * higher than we'll realistically need
-		 */
-		if (vk->max_textures > 1024)
-			vk->max_textures = 1024;
+		vk->max_textures =
+			vk12_props.maxPerStageDescriptorUpdateAfterBindSampledImages;
+		if (vk->max_textures >
+		    vk12_props.maxDescriptorSetUpdateAfterBindSampledImages)
+			vk->max_textures =
+				vk12_props.maxDescriptorSetUpdateAfterBindSampledImages;
+		if (vk->max_textures > VULKAN_MAX_TEXTURES)
+			vk->max_textures = VULKAN_MAX_TEXTURES;
+
+		vk->max_cache_size = props->limits.maxImageDimension2D;
+		if (vk->max_cache_size > props->limits.maxFramebufferWidth)
+			vk->max_cache_size = props->limits.maxFramebufferWidth;
+		if (vk->max_cache_size > props->limits.maxFramebufferHeight)
+			vk->max_cache_size = props->limits.maxFramebufferHeight;
+
+		/* Each of these is a power of two */
+		vk->stream_align = props->limits.minUniformBufferOffsetAlignment;
+		if (vk->stream_align < props->limits.minStorageBufferOffsetAlignment)
+			vk->stream_align = props->limits.minStorageBufferOffsetAlignment;
+		if (vk->stream_align < 16)
+			vk->stream_align = 16;
 
 		return 0;
 	}
@@ -312,6 +374,9 @@ vulkan_create(struct vulkan *vk, struct wl_display *wl)
 	if (create_logical_device(vk, gfx, xfer) < 0)
 		return -1;
 
+	printf("VK: Incremental present: %s\n",
+	       vk->incremental_present ? "yes" : "no");
+
 	if (vulkan_mm_setup_types(vk) < 0)
 		return -1;
 
@@ -336,13 +401,15 @@ vulkan_texture_create(struct vulkan *vk, int width, int height, int stride,
 	};
 
 	t = vulkan_mm_alloc_texture(vk, VK_FORMAT_R8_UNORM,
-				    width, height, &mapping);
+				    width, height, &mapping,
+				    VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+				    VK_IMAGE_USAGE_SAMPLED_BIT);
 	if (!t)
 		return NULL;
 
 
 	vulkan_mm_alloc_staging_buffer(vk, &staging, width * height);
-	data = staging.mem->data;
+	data = staging.data;
 
 	for (int i = 0; i < height; ++i)
 		memcpy(data[i], in_data[i], sizeof data[i]);
@@ -450,6 +517,7 @@ vulkan_texture_create(struct vulkan *vk, int width, int height, int stride,
 		.commandBufferCount = 1,
 		.pCommandBuffers = &cmd,
 	};
+	pthread_mutex_lock(&vk->gfx_queue->lock);
 	res = vkQueueSubmit(vk->gfx_queue->queue, 1, &submit_info,
 			    VK_NULL_HANDLE);
 	if (res < 0) {
@@ -458,6 +526,7 @@ vulkan_texture_create(struct vulkan *vk, int width, int height, int stride,
 	}
 
 	vkQueueWaitIdle(vk->gfx_queue->queue);
+	pthread_mutex_unlock(&vk->gfx_queue->lock);
 
 	vkFreeCommandBuffers(vk->logical_device, vk->gfx_queue->command_pool,
 			     1, &cmd);
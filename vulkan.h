@@ -3,29 +3,122 @@
 #ifndef NORI_VULKAN_H
 #define NORI_VULKAN_H
 
+#include <pthread.h>
 #include <stdbool.h>
 
 #include <vulkan/vulkan.h>
 #include <wayland-client-core.h>
 #include <wayland-client-protocol.h>
 
+#include "quad.h"
+#include "region.h"
+
 struct wayland_surface;
-struct scene;
+struct scene_snapshot;
 
 struct vulkan_queue {
 	uint32_t index;
 	VkQueue queue;
+	/* Only for use on the main thread */
 	VkCommandPool command_pool;
+	/* Surfaces submit and present from their render threads */
+	pthread_mutex_t lock;
+};
+
+/*
+ * What shader.vert gets for every quad it draws, one per instance. The quad
+ * stays as floats, since scaled and rotated views land between pixels, but
+ * the rest only needs 16 bits.
+ */
+struct vulkan_instance {
+	struct quad quad;
+	/* Part of the texture covering the quad: left, top, right, bottom */
+	uint16_t uv[4];
+	/* Index into the transforms */
+	uint32_t transform;
+	/* Texture slot, maybe with VULKAN_INSTANCE_PREMULTIPLIED */
+	uint16_t tex_id;
+	uint16_t opacity;
+};
+
+/* Set in tex_id for textures that are already premultiplied */
+#define VULKAN_INSTANCE_PREMULTIPLIED 0x8000
+
+/* For the UNORM16 parts of struct vulkan_instance */
+#define VULKAN_UNORM16_MAX 0xffff
+
+/*
+ * A run of instances for cull.comp to cull against the rectangle they're
+ * drawn into, which is also its push constants. Each group of
+ * VULKAN_CULL_GROUP_SIZE instances gets a VkDrawIndirectCommand, starting
+ * at command.
+ */
+struct vulkan_cull_pass {
+	/* Left, top, right, bottom, in scene space */
+	float clip[4];
+	/* Range of the slot list */
+	uint32_t first;
+	uint32_t count;
+	uint32_t command;
+	/*
+	 * Instances are shared between passes, so a cached layer's own
+	 * opacity gets divided out of its contents here instead.
+	 */
+	float opacity_scale;
 };
 
+#define VULKAN_CULL_GROUP_SIZE 64
+
 struct vulkan_renderpass {
 	VkRenderPass renderpass;
+	/* For drawing into layer caches; compatible with renderpass */
+	VkRenderPass cache_renderpass;
 
 	VkSampler sampler;
 
 	VkDescriptorSetLayout desc_layout;
 	VkPipelineLayout pipeline_layout;
 	VkPipeline pipeline;
+
+	/* Just the per-frame set, for cull.comp */
+	VkPipelineLayout cull_layout;
+	VkPipeline cull_pipeline;
+
+	/*
+	 * Every texture, indexed by its slot. The set is bound as is, and
+	 * textures are written into it when they're created.
+	 */
+	VkDescriptorSetLayout tex_layout;
+	VkDescriptorPool tex_pool;
+	VkDescriptorSet tex_set;
+	/* Guards the slots, and writes to the set */
+	pthread_mutex_t tex_lock;
+	uint32_t *free_tex_slots;
+	uint32_t num_free_tex_slots;
+	uint32_t next_tex_slot;
+};
+
+/* Texture slots have to fit in struct vulkan_instance.tex_id, beside the flag */
+#define VULKAN_MAX_TEXTURES 32768
+
+/*
+ * Device memory is allocated in blocks of 1 << VULKAN_MM_BLOCK_ORDER bytes,
+ * which get split buddy-style into powers of two, no smaller than
+ * 1 << VULKAN_MM_MIN_ORDER. Anything bigger than 1 << VULKAN_MM_MAX_ORDER
+ * gets memory of its own instead.
+ */
+#define VULKAN_MM_MIN_ORDER 8
+#define VULKAN_MM_MAX_ORDER 22
+#define VULKAN_MM_BLOCK_ORDER 24
+#define VULKAN_MM_NUM_ORDERS (VULKAN_MM_BLOCK_ORDER - VULKAN_MM_MIN_ORDER + 1)
+
+/*
+ * The blocks of one memory type. Buffers and images never share a block,
+ * so bufferImageGranularity doesn't matter.
+ */
+struct vulkan_heap {
+	/* struct vulkan_memory.link */
+	struct wl_list blocks;
 };
 
 struct vulkan {
@@ -50,21 +143,40 @@ struct vulkan {
 	 * texture_type:
 	 *   Should be in fastest device memory.
 	 *
-	 * uniform_type, vertex_type:
-	 *   Ideally CPU-accessable, but may not be.
+	 * stream_type:
+	 *   For data rewritten every frame, used as uniform, storage and
+	 *   vertex buffers. Always CPU-accessable and coherent.
+	 *
+	 * resident_type:
+	 *   For data kept between frames, only read by shaders and written
+	 *   by transfers. Should be in fastest device memory.
 	 */
 	uint32_t staging_type;
 	uint32_t texture_type;
-	uint32_t uniform_type;
-	uint32_t vertex_type;
+	uint32_t stream_type;
+	uint32_t resident_type;
+	/* What offsets into streamed buffers need to be a multiple of */
+	uint64_t stream_align;
 
 	uint32_t max_textures;
+	/* Layer caches any bigger than this get drawn at a lower resolution */
+	uint32_t max_cache_size;
+
+	/* VK_KHR_incremental_present */
+	bool incremental_present;
 
 	struct vulkan_renderpass renderpass;
+
+	/* Indexed by memory type; shared by every thread, so under mm_lock */
+	struct vulkan_heap buffer_heaps[VK_MAX_MEMORY_TYPES];
+	struct vulkan_heap image_heaps[VK_MAX_MEMORY_TYPES];
+	pthread_mutex_t mm_lock;
 };
 
 struct vulkan_memory {
+	/* struct vulkan_heap.blocks */
 	struct wl_list link;
+	/* How many buffers or textures are using it */
 	size_t ref;
 
 	VkDeviceMemory memory;
@@ -72,6 +184,12 @@ struct vulkan_memory {
 	void *data;
 
 	bool dedicated;
+	/*
+	 * For blocks, a binary tree of the pieces they can be split into,
+	 * whole block first. Each entry is one more than the order of the
+	 * biggest free piece within, or 0 if there isn't one.
+	 */
+	uint8_t *tree;
 };
 
 struct vulkan_buffer {
@@ -79,12 +197,89 @@ struct vulkan_buffer {
 	struct vulkan_memory *mem;
 	uint64_t offset;
 	uint64_t size;
+	/* Where the buffer is mapped, if it is */
+	void *data;
+	/* Size of its piece of a block, or 0 for dedicated memory */
+	int order;
+};
+
+/*
+ * Persistently mapped memory for per-frame data. Frames take space at the
+ * head and hand it back at the tail once their fence is signalled, which
+ * happens in the order they were submitted. Offsets only ever increase,
+ * and wrap around the buffer's size.
+ */
+struct vulkan_ring {
+	struct vulkan_buffer buffer;
+	uint64_t head;
+	uint64_t tail;
+	/* Bumped whenever the buffer is replaced with a bigger one */
+	uint32_t generation;
+};
+
+/* Smallest ring buffer we bother with */
+#define VULKAN_RING_MIN_SIZE (256 * 1024)
+
+/*
+ * What a surface keeps on the device between frames: the world transforms
+ * by transform id, an instance by slot, and the slots each pass draws, one
+ * after the other.
+ */
+enum vulkan_resident_type {
+	VULKAN_RESIDENT_TRANSFORMS,
+	VULKAN_RESIDENT_INSTANCES,
+	VULKAN_RESIDENT_SLOTS,
+	VULKAN_NUM_RESIDENT,
+};
+
+/*
+ * An array on the device, along with a copy of what it holds. Each frame
+ * gets compared against the copy, and only entries that differ are copied
+ * over from the ring.
+ */
+struct vulkan_resident {
+	struct vulkan_buffer buffer;
+	size_t stride;
+	/* The copy, of cap entries, and which of them are waiting to go */
+	void *data;
+	bool *pending;
+	uint32_t cap;
+
+	/*
+	 * Byte ranges of data to copy, in the order they're laid out in the
+	 * ring. Kept until they've been submitted, in case the frame isn't.
+	 */
+	VkBufferCopy *copies;
+	uint32_t num_copies;
+	uint32_t copies_cap;
+	uint64_t upload_size;
+
+	/*
+	 * Set once the buffer has been replaced, until the new one has been
+	 * given the first old_size bytes of the old one, and zeroes after.
+	 */
+	bool replaced;
+	VkBuffer old;
+	uint64_t old_size;
 };
 
 struct vulkan_texture {
+	/* struct vulkan_frame.garbage */
+	struct wl_list link;
+
 	VkImage image;
 	VkImageView view;
 	struct vulkan_memory *mem;
+	uint64_t offset;
+	int order;
+	/* Index into the renderpass's texture set, or -1 */
+	int32_t slot;
+
+	int width;
+	int height;
+
+	/* Only for textures we draw into */
+	VkFramebuffer framebuffer;
 };
 
 struct vulkan_image {
@@ -93,6 +288,12 @@ struct vulkan_image {
 	VkFramebuffer framebuffer;
 
 	bool undefined;
+
+	/*
+	 * How many frames ago this image was last presented,
+	 * with 0 meaning its contents are unknown.
+	 */
+	uint32_t age;
 };
 
 /* Per-frame resources */
@@ -101,16 +302,41 @@ struct vulkan_frame {
 
 	VkCommandBuffer command_buffer;
 
-	struct vulkan_buffer uniform;
-	struct vulkan_buffer vertex;
+	/*
+	 * Where this frame's data is in the surface's ring: the projection,
+	 * and whatever changed in the surface's resident arrays, to be copied
+	 * over. cull.comp writes whichever instances survive culling, and the
+	 * draws for them, after that.
+	 */
+	uint64_t uniform_offset;
+	uint64_t upload_offset;
+	uint64_t culled_offset;
+	uint64_t commands_offset;
+	/* The ring's head after this frame, and which buffer that was in */
+	uint64_t ring_end;
+	uint32_t ring_generation;
+	/* A ring buffer replaced during this frame, to free once it's done */
+	struct vulkan_buffer retired_ring;
+	/* Likewise for the resident arrays */
+	struct vulkan_buffer retired_resident[VULKAN_NUM_RESIDENT];
 
 	VkFence fence;
 
 	VkDescriptorSet desc;
+
+	/* Textures to free once the frame is done; struct vulkan_texture.link */
+	struct wl_list garbage;
 };
 
+/*
+ * How many frames of damage we remember. Images older than this get
+ * repainted in full.
+ */
+#define VULKAN_DAMAGE_HISTORY 4
+
 struct vulkan_surface {
 	struct vulkan *vk;
+	struct wayland_surface *wl_surf;
 
 	VkSurfaceKHR surface;
 	VkSwapchainKHR swapchain;
@@ -125,12 +351,30 @@ struct vulkan_surface {
 	struct vulkan_image *images;
 
 	VkDescriptorPool desc_pool;
+	/* Command buffers are only recorded on the render thread */
+	VkCommandPool command_pool;
+	/* Also only used on the render thread */
+	struct vulkan_ring ring;
+	struct vulkan_resident resident[VULKAN_NUM_RESIDENT];
 
 	VkSemaphore acquire;
 	VkSemaphore done;
 
 	struct vulkan_texture *texture;
 
+	/* Damage of the previously presented frames, most recent first */
+	struct region damage[VULKAN_DAMAGE_HISTORY];
+	/* Scene generation of the last presented frame */
+	uint64_t generation;
+
+	/* What cached layers were drawn into, indexed by node id */
+	struct vulkan_texture **caches;
+	uint32_t caches_cap;
+
+	/* The main pass, then each cache redrawn; only for one frame */
+	struct vulkan_cull_pass *passes;
+	uint32_t passes_cap;
+
 	struct wl_list frame_res;
 };
 
@@ -145,13 +389,25 @@ vulkan_surface_init(struct vulkan_surface *surf,
 void
 vulkan_surface_resize(struct vulkan_surface *surf, uint32_t w, uint32_t h);
 
+bool
+vulkan_surface_needs_repaint(struct vulkan_surface *surf,
+			     const struct scene_snapshot *snap);
+
+/* 0 once the snapshot has been drawn and presented */
 int
-vulkan_surface_repaint(struct vulkan_surface *vk_surface, struct scene *scene);
+vulkan_surface_repaint(struct vulkan_surface *vk_surface,
+		       const struct scene_snapshot *snap);
 
 int
 vulkan_init_renderpass(struct vulkan *vk,
 		       struct vulkan_renderpass *rp);
 
+/* Gives the texture a slot in the texture set, for drawing with */
+int
+vulkan_renderpass_add_texture(struct vulkan *vk, struct vulkan_texture *t);
+void
+vulkan_renderpass_remove_texture(struct vulkan *vk, struct vulkan_texture *t);
+
 struct vulkan_texture *
 vulkan_texture_create(struct vulkan *vk, int width, int height, int stride,
 		      void *data);
@@ -162,16 +418,32 @@ vulkan_mm_setup_types(struct vulkan *vk);
 int
 vulkan_mm_alloc_staging_buffer(struct vulkan *vk, struct vulkan_buffer *b,
 			       size_t size);
+/* Device memory, for storage buffers copied to and from */
 int
-vulkan_mm_alloc_uniform_buffer(struct vulkan *vk, struct vulkan_buffer *b,
-			       size_t size);
+vulkan_mm_alloc_resident_buffer(struct vulkan *vk, struct vulkan_buffer *b,
+				size_t size);
+
+/*
+ * Finds size contiguous bytes in the ring, at a multiple of stream_align.
+ * If they don't fit, the ring's buffer is replaced with a bigger one, and
+ * the old one is moved to *retired. It can be freed once everything
+ * submitted so far is done. Only call this once per frame.
+ */
 int
-vulkan_mm_alloc_vertex_buffer(struct vulkan *vk, struct vulkan_buffer *b,
-			      size_t size);
+vulkan_mm_ring_alloc(struct vulkan *vk, struct vulkan_ring *ring,
+		     uint64_t size, uint64_t *offset,
+		     struct vulkan_buffer *retired);
+/* Hands back everything before end, if it's from the current buffer */
+void
+vulkan_mm_ring_release(struct vulkan_ring *ring, uint32_t generation,
+		       uint64_t end);
 
 struct vulkan_texture *
 vulkan_mm_alloc_texture(struct vulkan *vk, VkFormat format,
-			int width, int height, const VkComponentMapping *mapping);
+			int width, int height, const VkComponentMapping *mapping,
+			VkImageUsageFlags usage);
+void
+vulkan_mm_free_texture(struct vulkan *vk, struct vulkan_texture *t);
 
 void
 vulkan_mm_free_buffer(struct vulkan *vk, struct vulkan_buffer *b);
@@ -57,7 +57,11 @@ static const struct wl_callback_listener frame_listener = {
 static void
 feedback_destroy(struct feedback *fb)
 {
+	struct wayland_surface *surf = fb->surf;
+
+	pthread_mutex_lock(&surf->lock);
 	wl_list_remove(&fb->link);
+	pthread_mutex_unlock(&surf->lock);
 	free(fb);
 }
 
@@ -115,12 +119,17 @@ wayland_surface_add_feedback(struct wayland_surface *surf)
 		return;
 
 	fb->surf = surf;
+
+	pthread_mutex_lock(&surf->lock);
+
 	fb->feedback = wp_presentation_feedback(wl->presentation, surf->surf);
 	clock_gettime(wl->clock_id, &fb->committed);
 
 	wp_presentation_feedback_add_listener(fb->feedback, &feedback_listener, fb);
 
 	wl_list_insert(&surf->feedback, &fb->link);
+
+	pthread_mutex_unlock(&surf->lock);
 }
 
 void
@@ -139,10 +148,14 @@ wayland_surface_schedule_repaint(struct wayland_surface *surf)
 	if (surf->frame)
 		return;
 
+	pthread_mutex_lock(&surf->lock);
+
 	surf->frame = wl_surface_frame(surf->surf);
 	wl_callback_add_listener(surf->frame, &frame_listener, surf);
 
 	wl_surface_commit(surf->surf);
+
+	pthread_mutex_unlock(&surf->lock);
 }
 
 static void
@@ -153,23 +166,103 @@ wayland_surface_init(struct wayland_surface *surf, struct wayland *wl,
 	surf->repaint = repaint;
 	surf->repaint_priv = data;
 
+	pthread_mutex_init(&surf->lock, NULL);
 	wl_list_init(&surf->feedback);
 
 	surf->surf = wl_compositor_create_surface(wl->compositor);
+	wl_surface_set_user_data(surf->surf, surf);
+}
+
+static void
+render_frame(struct wayland_toplevel *top, bool acked,
+	     int32_t width, int32_t height)
+{
+	const struct scene_snapshot *snap;
+	bool drawn = true;
+
+	if (top->vk_surf.width != width || top->vk_surf.height != height)
+		vulkan_surface_resize(&top->vk_surf, width, height);
+
+	snap = scene_acquire_snapshot(top->scene);
+
+	/*
+	 * Nothing visible changed, so don't bother producing a new frame.
+	 * The ack still needs a commit to take effect though.
+	 */
+	if (!snap || !vulkan_surface_needs_repaint(&top->vk_surf, snap)) {
+		if (acked) {
+			pthread_mutex_lock(&top->base.lock);
+			wl_surface_commit(top->base.surf);
+			pthread_mutex_unlock(&top->base.lock);
+		}
+	} else {
+		wayland_surface_add_feedback(&top->base);
+		drawn = vulkan_surface_repaint(&top->vk_surf, snap) == 0;
+	}
+
+	/* Caches it said to redraw or free still need it, next time round */
+	if (snap && !drawn)
+		scene_return_snapshot(top->scene);
+	else if (snap)
+		scene_release_snapshot(top->scene);
+}
+
+/*
+ * Waits for the main thread to ask for a frame, so building the command
+ * buffers and presenting never holds up dispatching events there.
+ */
+static void *
+render_thread(void *data)
+{
+	struct wayland_toplevel *top = data;
+
+	pthread_mutex_lock(&top->render_lock);
+
+	for (;;) {
+		while (!top->render_requested)
+			pthread_cond_wait(&top->render_cond, &top->render_lock);
+
+		bool acked = top->render_acked;
+		int32_t width = top->render_width;
+		int32_t height = top->render_height;
+
+		top->render_requested = false;
+		top->render_acked = false;
+
+		pthread_mutex_unlock(&top->render_lock);
+		render_frame(top, acked, width, height);
+		pthread_mutex_lock(&top->render_lock);
+	}
+
+	return NULL;
 }
 
 static void
 wayland_toplevel_repaint(struct wayland_surface *surf, void *data)
 {
 	struct wayland_toplevel *top = data;
+	bool acked = false;
 
 	if (top->conf.serial) {
 		xdg_surface_ack_configure(top->xdg, top->conf.serial);
 		top->conf.serial = 0;
+		acked = true;
 	}
 
-	wayland_surface_add_feedback(&top->base);
-	vulkan_surface_repaint(&top->vk_surf, top->scene);
+	/*
+	 * Applies what other threads queued up in a transaction, and the
+	 * commit publishes that along with any changes made here outside of
+	 * one.
+	 */
+	scene_queue_apply(&top->ops, top->scene);
+
+	pthread_mutex_lock(&top->render_lock);
+	top->render_requested = true;
+	top->render_acked |= acked;
+	top->render_width = top->width;
+	top->render_height = top->height;
+	pthread_cond_signal(&top->render_cond);
+	pthread_mutex_unlock(&top->render_lock);
 }
 
 static void
@@ -183,12 +276,17 @@ xdg_configure(void *data, struct xdg_surface *xdg, uint32_t serial)
 	if (top->conf.height == 0)
 		top->conf.height = 500;
 
-	if (top->vk_surf.width != top->conf.width ||
-	    top->vk_surf.height != top->conf.height) {
-
-		vulkan_surface_resize(&top->vk_surf,
-				      top->conf.width,
-				      top->conf.height);
+	/* The render thread resizes the swapchain at the next repaint */
+	if (top->width != top->conf.width ||
+	    top->height != top->conf.height) {
+		const struct rect viewport = {
+			.width = top->conf.width,
+			.height = top->conf.height,
+		};
+
+		top->width = top->conf.width;
+		top->height = top->conf.height;
+		scene_set_viewport(top->scene, &viewport);
 	}
 
 	if (top->base.mapped)
@@ -247,6 +345,7 @@ struct wayland_toplevel *
 wayland_toplevel_create(struct wayland *wl, struct vulkan *vk)
 {
 	struct wayland_toplevel *top;
+	int err;
 
 	top = calloc(1, sizeof *top);
 	if (!top)
@@ -255,12 +354,24 @@ wayland_toplevel_create(struct wayland *wl, struct vulkan *vk)
 	wayland_surface_init(&top->base, wl, wayland_toplevel_repaint, top);
 
 	top->scene = scene_create();
-	top->root = scene_layer_create();
+	top->root = scene_layer_create(top->scene);
 	scene_set_root(top->scene, top->root);
+	top->base.scene = top->scene;
+
+	if (scene_queue_init(&top->ops, WAYLAND_OPS_QUEUE_SIZE) < 0)
+		goto error;
 
 	if (vulkan_surface_init(&top->vk_surf, vk, &top->base) < 0)
 		goto error;
 
+	pthread_mutex_init(&top->render_lock, NULL);
+	pthread_cond_init(&top->render_cond, NULL);
+	err = pthread_create(&top->render_thread, NULL, render_thread, top);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		goto error;
+	}
+
 	top->xdg = xdg_wm_base_get_xdg_surface(wl->wm_base, top->base.surf);
 	top->toplevel = xdg_surface_get_toplevel(top->xdg);
 
@@ -76,6 +76,18 @@ pointer_frame(void *data, struct wl_pointer *p)
 	}
 	if (s->fields & POINTER_LEAVE) {
 		s->cursor->base.mapped = false;
+		s->pointer_focus = NULL;
+	}
+	if (s->enter_surf && s->fields & (POINTER_ENTER | POINTER_MOTION)) {
+		struct wayland_surface *surf =
+			wl_surface_get_user_data(s->enter_surf);
+		double x = s->fields & POINTER_MOTION ?
+			s->motion_x : s->enter_x;
+		double y = s->fields & POINTER_MOTION ?
+			s->motion_y : s->enter_y;
+
+		if (surf && surf->scene)
+			s->pointer_focus = scene_pick(surf->scene, x, y);
 	}
 
 	s->fields = 0;
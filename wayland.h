@@ -4,6 +4,7 @@
 #define NORI_WAYLAND_H
 
 #define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
@@ -18,6 +19,7 @@
 #include "xdg-shell-protocol.h"
 
 #include "scene.h"
+#include "scene-queue.h"
 #include "vulkan.h"
 
 struct wayland_surface;
@@ -51,6 +53,16 @@ struct wayland_surface {
 	void (*repaint)(struct wayland_surface *, void *);
 	void *repaint_priv;
 
+	/* What's shown on the surface, if it's drawn from a scene */
+	struct scene *scene;
+
+	/*
+	 * The render thread makes requests on the surface too. Guards the
+	 * feedback list, and keeps requests that go together, like a frame
+	 * callback and its commit, from being split up.
+	 */
+	pthread_mutex_t lock;
+
 	struct wl_callback *frame;
 	struct wl_list feedback; /* struct feedback.link */
 	struct timespec predicted_time;
@@ -67,12 +79,17 @@ struct feedback {
 	struct timespec committed;
 };
 
+/* How many scene operations other threads can queue up between repaints */
+#define WAYLAND_OPS_QUEUE_SIZE 4096
+
 struct wayland_toplevel {
 	struct wayland_surface base;
 	struct wayland *wl;
 
 	struct scene *scene;
 	struct scene_layer *root;
+	/* Changes to the scene from other threads, applied before repaints */
+	struct scene_queue ops;
 	struct vulkan_surface vk_surf;
 
 	struct xdg_surface *xdg;
@@ -83,6 +100,19 @@ struct wayland_toplevel {
 	int32_t width;
 	int32_t height;
 
+	/*
+	 * Frames are drawn on a thread of their own, from the latest scene
+	 * snapshot. The requests below are guarded by render_lock.
+	 */
+	pthread_t render_thread;
+	pthread_mutex_t render_lock;
+	pthread_cond_t render_cond;
+	bool render_requested;
+	/* A configure was acked, which needs a commit even if nothing changed */
+	bool render_acked;
+	int32_t render_width;
+	int32_t render_height;
+
 	struct {
 		uint32_t serial;
 		int32_t width;
@@ -134,6 +164,9 @@ struct wayland_seat {
 	uint32_t leave_serial;
 
 	double motion_x, motion_y;
+
+	/* View under the pointer */
+	struct scene_view *pointer_focus;
 };
 
 int